@@ -0,0 +1,86 @@
+// Frames per second of screens_grab with MIT-SHM and with the XGetSubImage
+// fallback, on the first screen of the X display. Both paths must return
+// the same pixels. Needs a display: `make run-capture` starts an Xvfb per
+// resolution.
+//
+//   capture [frames]
+
+#include "../screen.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// Grabs `frames` frames and keeps a copy of the last one in `last`, returns
+// the frames per second or 0 if a grab failed.
+double measure(screen * s, int frames, unsigned char * last, int * shm)
+{
+    bitmap * frame = NULL;
+    double t0 = now();
+    for(int i = 0; i < frames; i++) {
+        frame = screens_grab(s);
+        if(frame == NULL) {
+            return 0;
+        }
+    }
+    double elapsed = now() - t0;
+
+    for(int y = 0; y < frame->height; y++) {
+        memcpy(last + y * frame->width * BITMAP_BPP, frame->data + y * frame->stride,
+               frame->width * BITMAP_BPP);
+    }
+    x11_capture * cap = s->data;
+    *shm = cap->use_shm;
+    capture_release(get_display(), cap);
+    s->data = NULL;
+    return frames / elapsed;
+}
+
+int main(int argc, char ** argv)
+{
+    int frames = argc > 1 ? atoi(argv[1]) : 200;
+    Display * display = get_display();
+    if(display == NULL) {
+        printf("no X display, run it under Xvfb (make run-capture)\n");
+        return 1;
+    }
+
+    // Xvfb may not expose a RandR output, the root window is enough then.
+    screens * list = screens_get();
+    screen root = { "root", 0, 0, XDisplayWidth(display, XDefaultScreen(display)),
+                    XDisplayHeight(display, XDefaultScreen(display)), NULL };
+    screen * s = list->count > 0 ? list->list[0] : &root;
+
+    size_t size = (size_t) s->width * s->height * BITMAP_BPP;
+    unsigned char * shm_frame = malloc(size);
+    unsigned char * get_frame = malloc(size);
+    int shm = 0;
+    int fallback_shm = 0;
+
+    capture_shm = 1;
+    double shm_fps = measure(s, frames, shm_frame, &shm);
+    capture_shm = 0;
+    double get_fps = measure(s, frames, get_frame, &fallback_shm);
+
+    printf("%dx%d: %s %.1f fps, XGetSubImage %.1f fps\n", s->width, s->height,
+           shm ? "XShmGetImage" : "XGetSubImage (no MIT-SHM)", shm_fps, get_fps);
+    int failed = shm_fps == 0 || get_fps == 0 || fallback_shm;
+    if(failed) {
+        printf("  FAILED: a grab failed\n");
+    } else if(memcmp(shm_frame, get_frame, size)) {
+        printf("  FAILED: the two paths returned different pixels\n");
+        failed = 1;
+    }
+
+    free(shm_frame);
+    free(get_frame);
+    screens_release(list);
+    return failed;
+}
@@ -0,0 +1,108 @@
+// Checks the AVX2 DCT + quantization of tiny_jpeg against the scalar path
+// on random and smooth blocks, and times both in blocks per second.
+//
+//   dct [rounds]
+
+#define TJE_IMPLEMENTATION
+#include "../libs/tiny_jpeg.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define DCT_BLOCKS 4096
+
+double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// Half noise, half gradients: level shifted samples like the encoder feeds.
+void fill(float * blocks)
+{
+    uint32_t state = 12345;
+    for(int b = 0; b < DCT_BLOCKS; b++) {
+        for(int i = 0; i < 64; i++) {
+            state = state * 1103515245 + 12345;
+            int sample = b % 2 ? (int)((state >> 16) & 0xff) : (b * 7 + (i % 8) * 9 + (i / 8) * 5) & 0xff;
+            blocks[b * 64 + i] = (float) sample - 128;
+        }
+    }
+}
+
+void set_quality(TJEState * state, int quality)
+{
+    for(int i = 0; i < 64; i++) {
+        state->qt_luma[i] = quality == 3 ? 1 : tjei_default_qt_luma_from_spec[i];
+        state->qt_chroma[i] = quality == 3 ? 1 : tjei_default_qt_chroma_from_paper[i];
+    }
+}
+
+// Number of blocks whose coefficients differ between the two paths.
+int compare(TJEState * state, float * blocks, float * qt)
+{
+    int mismatches = 0;
+    for(int b = 0; b < DCT_BLOCKS; b++) {
+        int scalar[64], avx2[64];
+        state->use_avx2 = 0;
+        tjei_quantize_MCU(state, blocks + b * 64, qt, scalar);
+        state->use_avx2 = 1;
+        tjei_quantize_MCU(state, blocks + b * 64, qt, avx2);
+        mismatches += memcmp(scalar, avx2, sizeof(scalar)) != 0;
+    }
+    return mismatches;
+}
+
+double blocks_per_second(TJEState * state, float * blocks, float * qt, int rounds)
+{
+    int du[64];
+    volatile int sink = 0;
+    double t0 = now();
+    for(int r = 0; r < rounds; r++) {
+        for(int b = 0; b < DCT_BLOCKS; b++) {
+            tjei_quantize_MCU(state, blocks + b * 64, qt, du);
+            sink += du[1];
+        }
+    }
+    return (double) rounds * DCT_BLOCKS / (now() - t0);
+}
+
+int main(int argc, char ** argv)
+{
+    int rounds = argc > 1 ? atoi(argv[1]) : 100;
+    float * blocks = malloc(DCT_BLOCKS * 64 * sizeof(float));
+    TJEState * state = calloc(1, sizeof(TJEState));
+    int failed = 0;
+
+    fill(blocks);
+#if TJEI_AVX2
+    struct TJEProcessedQT pqt;
+    if(!tjei_cpu_has_avx2()) {
+        printf("no AVX2 on this CPU, nothing to compare\n");
+        return 0;
+    }
+    for(int quality = 1; quality <= 3; quality += 2) {
+        set_quality(state, quality);
+        tjei_process_qt(state, &pqt);
+        int luma = compare(state, blocks, pqt.luma);
+        int chroma = compare(state, blocks, pqt.chroma);
+        printf("quality %d: %d + %d of %d blocks differ from the scalar path\n", quality, luma, chroma, 2 * DCT_BLOCKS);
+        failed |= luma || chroma;
+    }
+
+    state->use_avx2 = 0;
+    double scalar = blocks_per_second(state, blocks, pqt.luma, rounds);
+    state->use_avx2 = 1;
+    double avx2 = blocks_per_second(state, blocks, pqt.luma, rounds);
+    printf("scalar %.1f Mblocks/s, avx2 %.1f Mblocks/s (%.2fx)\n", scalar / 1e6, avx2 / 1e6, avx2 / scalar);
+#else
+    (void) rounds;
+    printf("built without the AVX2 kernels, nothing to compare\n");
+#endif
+
+    free(state);
+    free(blocks);
+    return failed;
+}
@@ -0,0 +1,361 @@
+// Checks the tiny_jpeg encoder end to end on the synthetic sources. Every
+// JPEG is decoded with libjpeg (the tree only vendors stb_image_resize, not
+// stb_image).
+//
+//  - Every quality, sampling, pixel format and stride must decode above
+//    min_psnr, and every format and stride to the same pixels as the packed
+//    RGB input.
+//  - Restart-marker slices, serial and parallel, must decode to the same
+//    pixels as a plain tje_encode_with_func encode.
+//  - So must a persistent encoder, with and without slices, cached blocks
+//    and optimized Huffman tables, both to memory and through a write
+//    function, frame after frame.
+//
+//   encode
+
+#define TJE_IMPLEMENTATION
+#include "../libs/tiny_jpeg.h"
+#include "../source.h"
+#include "../threads.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+
+#define ENCODE_FRAMES 6
+#define ENCODE_OFFSET 64
+
+// Lowest PSNR in dB allowed per quality (1 to 3) and sampling, a little
+// under the worst synthetic frame. The small text sets all of them: at
+// quality 1 its luma, above that the one pixel wide colored glyph edges
+// that subsampled chroma can't keep.
+static const double min_psnr[3][3] = {
+    // 4:4:4  4:2:2  4:2:0
+    { 24.0, 24.0, 24.0 },   // quality 1
+    { 42.0, 34.0, 32.0 },   // quality 2
+    { 50.0, 35.0, 32.0 },   // quality 3
+};
+
+static const char * sampling_names[] = { "4:4:4", "4:2:2", "4:2:0" };
+static const char * pattern_names[] = { "desktop", "text", "video" };
+static const int formats[] = { TJE_FORMAT_RGB, TJE_FORMAT_RGBA, TJE_FORMAT_RGBX, TJE_FORMAT_BGRA, TJE_FORMAT_BGRX };
+static const int sizes[][2] = { { 320, 240 }, { 331, 197 } };
+
+typedef struct _jpeg {
+    unsigned char * data;
+    size_t size;
+    size_t capacity;
+} jpeg;
+
+typedef struct _decode_error {
+    struct jpeg_error_mgr mgr;
+    jmp_buf jump;
+} decode_error;
+
+scheduler * slices_scheduler;
+int failures;
+
+void jpeg_write(void * context, void * data, int size)
+{
+    jpeg * j = context;
+    if(j->size + size > j->capacity) {
+        j->capacity = (j->size + size) * 2;
+        j->data = realloc(j->data, j->capacity);
+    }
+    memcpy(j->data + j->size, data, size);
+    j->size += size;
+}
+
+void decode_fail(j_common_ptr info)
+{
+    longjmp(((decode_error *) info->err)->jump, 1);
+}
+
+// Decodes to packed RGB, returns 0 if the JPEG is broken or has another size.
+int decode(const unsigned char * data, size_t size, int width, int height, unsigned char * rgb)
+{
+    struct jpeg_decompress_struct info;
+    decode_error error;
+    info.err = jpeg_std_error(&error.mgr);
+    error.mgr.error_exit = decode_fail;
+    if(setjmp(error.jump)) {
+        jpeg_destroy_decompress(&info);
+        return 0;
+    }
+    jpeg_create_decompress(&info);
+    jpeg_mem_src(&info, (unsigned char *) data, (unsigned long) size);
+    jpeg_read_header(&info, TRUE);
+    info.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&info);
+    if((int) info.output_width != width || (int) info.output_height != height) {
+        jpeg_destroy_decompress(&info);
+        return 0;
+    }
+    while(info.output_scanline < info.output_height) {
+        JSAMPROW row = rgb + (size_t) info.output_scanline * width * 3;
+        jpeg_read_scanlines(&info, &row, 1);
+    }
+    jpeg_finish_decompress(&info);
+    jpeg_destroy_decompress(&info);
+    return 1;
+}
+
+double psnr(const unsigned char * a, const unsigned char * b, size_t count)
+{
+    double sum = 0;
+    for(size_t i = 0; i < count; i++) {
+        double d = (double) a[i] - b[i];
+        sum += d * d;
+    }
+    return sum == 0 ? 99 : 10 * log10(255.0 * 255.0 * count / sum);
+}
+
+int restart_markers(const jpeg * j)
+{
+    int count = 0;
+    for(size_t i = 0; i + 1 < j->size; i++) {
+        count += j->data[i] == 0xff && j->data[i + 1] >= 0xd0 && j->data[i + 1] <= 0xd7;
+    }
+    return count;
+}
+
+void fail(const char * what, const char * pattern, int width, int height, int sampling)
+{
+    printf("  FAILED: %s, %s %dx%d %s\n", what, pattern, width, height, sampling_names[sampling]);
+    failures++;
+}
+
+// Copies a BGRX bitmap into `format`, with `pad` extra bytes per row. The
+// padding and X bytes are filled with garbage the encoder must ignore.
+unsigned char * convert(const bitmap * b, int format, int pad, int * stride)
+{
+    int bpp = format == TJE_FORMAT_RGB ? 3 : 4;
+    int bgr = format == TJE_FORMAT_BGRA || format == TJE_FORMAT_BGRX;
+    *stride = b->width * bpp + pad;
+    unsigned char * out = malloc((size_t) *stride * b->height);
+    memset(out, 0x5a, (size_t) *stride * b->height);
+    for(int y = 0; y < b->height; y++) {
+        const unsigned char * src = (const unsigned char *) b->data + (size_t) y * b->stride;
+        unsigned char * dst = out + (size_t) y * *stride;
+        for(int x = 0; x < b->width; x++) {
+            dst[x * bpp + 0] = src[x * 4 + (bgr ? 0 : 2)];
+            dst[x * bpp + 1] = src[x * 4 + 1];
+            dst[x * bpp + 2] = src[x * 4 + (bgr ? 2 : 0)];
+            if(format == TJE_FORMAT_RGBA || format == TJE_FORMAT_BGRA) {
+                dst[x * bpp + 3] = 0xff;
+            }
+        }
+    }
+    return out;
+}
+
+// Plain encode of a BGRX frame, decoded. Everything else is compared to it.
+int reference(const bitmap * b, int quality, int sampling, unsigned char * rgb)
+{
+    jpeg j = { NULL, 0, 0 };
+    int ok = tje_encode_with_func(jpeg_write, &j, quality, sampling, b->width, b->height,
+                                  TJE_FORMAT_BGRX, b->stride, (const unsigned char *) b->data) &&
+             decode(j.data, j.size, b->width, b->height, rgb);
+    free(j.data);
+    return ok;
+}
+
+// Every quality, sampling, format and stride of one frame. Returns the
+// lowest PSNR seen per quality and sampling in `worst`.
+void check_formats(const bitmap * b, const char * pattern, double worst[3][3])
+{
+    size_t count = (size_t) b->width * b->height * 3;
+    unsigned char * source_rgb = malloc(count);
+    unsigned char * first = malloc(count);
+    unsigned char * rgb = malloc(count);
+    int stride;
+    unsigned char * packed = convert(b, TJE_FORMAT_RGB, 0, &stride);
+    memcpy(source_rgb, packed, count);
+    free(packed);
+
+    for(int quality = 1; quality <= 3; quality++) {
+        for(int sampling = 0; sampling < 3; sampling++) {
+            for(int f = 0; f < 5; f++) {
+                for(int pad = 0; pad <= 12; pad += 12) {
+                    unsigned char * input = convert(b, formats[f], pad, &stride);
+                    jpeg j = { NULL, 0, 0 };
+                    int ok = tje_encode_with_func(jpeg_write, &j, quality, sampling, b->width, b->height,
+                                                  formats[f], pad ? stride : 0, input) &&
+                             decode(j.data, j.size, b->width, b->height, rgb);
+                    free(j.data);
+                    free(input);
+                    if(!ok) {
+                        fail("encode or decode", pattern, b->width, b->height, sampling);
+                        continue;
+                    }
+                    if(f == 0 && pad == 0) {
+                        memcpy(first, rgb, count);
+                    } else if(memcmp(first, rgb, count)) {
+                        fail("pixel format or stride changed the pixels", pattern, b->width, b->height, sampling);
+                    }
+                    double db = psnr(source_rgb, rgb, count);
+                    if(db < worst[quality - 1][sampling]) {
+                        worst[quality - 1][sampling] = db;
+                    }
+                    if(db < min_psnr[quality - 1][sampling]) {
+                        fail("PSNR too low", pattern, b->width, b->height, sampling);
+                    }
+                }
+            }
+        }
+    }
+    free(source_rgb);
+    free(first);
+    free(rgb);
+}
+
+void check_slices(const bitmap * b, const char * pattern, int sampling)
+{
+    size_t count = (size_t) b->width * b->height * 3;
+    unsigned char * expected = malloc(count);
+    unsigned char * rgb = malloc(count);
+    if(!reference(b, 3, sampling, expected)) {
+        fail("plain encode", pattern, b->width, b->height, sampling);
+    }
+    for(int slice_rows = 1; slice_rows <= 3; slice_rows += 2) {
+        for(int parallel = 0; parallel < 2; parallel++) {
+            jpeg j = { NULL, 0, 0 };
+            int ok = tje_encode_sliced_with_func(jpeg_write, &j, parallel ? scheduler_parallel : NULL,
+                                                 slices_scheduler, slice_rows, 3, sampling, b->width, b->height,
+                                                 TJE_FORMAT_BGRX, b->stride, (const unsigned char *) b->data) &&
+                     decode(j.data, j.size, b->width, b->height, rgb);
+            if(!ok || memcmp(expected, rgb, count)) {
+                fail(parallel ? "parallel slices" : "serial slices", pattern, b->width, b->height, sampling);
+            } else if(restart_markers(&j) == 0) {
+                fail("no restart markers", pattern, b->width, b->height, sampling);
+            }
+            free(j.data);
+        }
+    }
+    free(expected);
+    free(rgb);
+}
+
+// Frame after frame of `pattern` through one encoder, to memory and through
+// a write function. Returns the average JPEG size.
+double check_encoder(synthetic_pattern pattern, int width, int height, int sampling,
+                     int slice_rows, int cache, int huffman)
+{
+    source * src = source_synthetic(width, height, pattern);
+    screen * s = src->screens->list[0];
+    rects * dirty = rects_create(0);
+    size_t count = (size_t) width * height * 3;
+    unsigned char * expected = malloc(count);
+    unsigned char * rgb = malloc(count);
+    unsigned char * buffer = NULL;
+    size_t capacity = 0;
+    size_t total = 0;
+
+    tje_encoder * enc = NULL;
+    for(int frame = 0; frame < ENCODE_FRAMES; frame++) {
+        bitmap * b = source_grab(src, s, dirty);
+        if(enc == NULL) {
+            enc = tje_encoder_create(3, sampling, width, height, TJE_FORMAT_BGRX, b->stride, slice_rows,
+                                     slice_rows ? scheduler_parallel : NULL, slices_scheduler);
+            if(enc == NULL || (cache && !tje_encoder_cache_blocks(enc, 1))) {
+                fail("encoder setup", pattern_names[pattern], width, height, sampling);
+                break;
+            }
+            tje_encoder_optimize_huffman(enc, huffman);
+        }
+        if(!reference(b, 3, sampling, expected)) {
+            fail("plain encode", pattern_names[pattern], width, height, sampling);
+            continue;
+        }
+
+        if(buffer) memset(buffer, 0xa5, ENCODE_OFFSET);
+        size_t size = tje_encoder_encode_to_memory(enc, &buffer, &capacity, ENCODE_OFFSET,
+                                                   (const unsigned char *) b->data);
+        int untouched = size > 0;
+        for(int i = 0; i < ENCODE_OFFSET && frame > 0 && untouched; i++) {
+            untouched = buffer[i] == 0xa5;
+        }
+        if(!untouched || !decode(buffer + ENCODE_OFFSET, size, width, height, rgb) || memcmp(expected, rgb, count)) {
+            fail("encoder to memory", pattern_names[pattern], width, height, sampling);
+        }
+        total += size;
+
+        // The same frame again, every cached block now hits.
+        jpeg j = { NULL, 0, 0 };
+        if(!tje_encoder_encode(enc, jpeg_write, &j, (const unsigned char *) b->data) ||
+           !decode(j.data, j.size, width, height, rgb) || memcmp(expected, rgb, count)) {
+            fail("encoder with write function", pattern_names[pattern], width, height, sampling);
+        }
+        free(j.data);
+    }
+
+    if(enc) tje_encoder_release(enc);
+    free(buffer);
+    free(expected);
+    free(rgb);
+    rects_release(dirty);
+    source_release(src);
+    return (double) total / ENCODE_FRAMES;
+}
+
+int main(int argc, char ** argv)
+{
+    slices_scheduler = scheduler_create(0);
+
+    double worst[3][3];
+    for(int i = 0; i < 9; i++) worst[i / 3][i % 3] = 99;
+    for(int p = 0; p < 3; p++) {
+        for(int z = 0; z < 2; z++) {
+            source * src = source_synthetic(sizes[z][0], sizes[z][1], (synthetic_pattern) p);
+            rects * dirty = rects_create(0);
+            // A later frame, so that the text has scrolled and the video moved.
+            bitmap * b = NULL;
+            for(int i = 0; i < 3; i++) b = source_grab(src, src->screens->list[0], dirty);
+            check_formats(b, pattern_names[p], worst);
+            for(int sampling = 0; sampling < 3; sampling++) {
+                check_slices(b, pattern_names[p], sampling);
+            }
+            rects_release(dirty);
+            source_release(src);
+        }
+    }
+    printf("lowest PSNR over %d formats x 2 strides (limit):\n", (int)(sizeof(formats) / sizeof(formats[0])));
+    for(int q = 0; q < 3; q++) {
+        printf("  quality %d:", q + 1);
+        for(int sampling = 0; sampling < 3; sampling++) {
+            printf("  %s %.1f dB (%.0f)", sampling_names[sampling], worst[q][sampling], min_psnr[q][sampling]);
+        }
+        printf("\n");
+    }
+
+    printf("encoder, %d frames, bytes per frame:\n", ENCODE_FRAMES);
+    printf("  %-8s %-6s %6s %6s %8s %8s %8s\n", "pattern", "", "slices", "cache", "huffman", "320x240", "331x197");
+    for(int p = 0; p < 3; p++) {
+        for(int sampling = 0; sampling < 3; sampling++) {
+            for(int config = 0; config < 12; config++) {
+                int slice_rows = config & 1 ? 2 : 0;
+                int cache = config & 2 ? 1 : 0;
+                int huffman = config / 4 == 0 ? 0 : config / 4 == 1 ? 1 : 3;
+                double small = check_encoder((synthetic_pattern) p, sizes[0][0], sizes[0][1], sampling,
+                                             slice_rows, cache, huffman);
+                double odd = check_encoder((synthetic_pattern) p, sizes[1][0], sizes[1][1], sampling,
+                                           slice_rows, cache, huffman);
+                if(sampling == 2 && (config == 0 || config == 4 || config == 11)) {
+                    printf("  %-8s %-6s %6d %6d %8d %8.0f %8.0f\n", pattern_names[p], sampling_names[sampling],
+                           slice_rows, cache, huffman, small, odd);
+                }
+            }
+        }
+    }
+
+    if(failures) {
+        printf("FAILED: %d checks\n", failures);
+    } else {
+        printf("every encode decoded as expected\n");
+    }
+    scheduler_release(slices_scheduler);
+    return failures != 0;
+}
@@ -0,0 +1,154 @@
+// Loopback packets per second of read_packet on a socket_reader, against
+// the previous reader that fetched every byte with its own socket_read
+// (one recv each). Every payload is checked, and read_packet must return
+// NULL once the writer has closed the connection.
+//
+//   reader [port]
+
+#include "../network.h"
+#include "../threads.h"
+
+#include <stdio.h>
+#include <time.h>
+
+typedef struct _reader_run {
+    sock listener;
+    int count;
+    long size;
+} reader_run;
+
+double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+void send_packets(void * arg)
+{
+    reader_run * run = arg;
+    sock s = socket_accept(run->listener);
+    packet p;
+    strcpy(p.boundary, "frame");
+    strcpy(p.type, "image/jpeg");
+    p.size = run->size;
+    p.payload = malloc(run->size);
+    for(int i = 0; i < run->count; i++) {
+        for(long k = 0; k < run->size; k++) {
+            p.payload[k] = (char)(i + k);
+        }
+        write_packet(s, &p);
+    }
+    free(p.payload);
+    socket_close_peer(s);
+}
+
+// The reader before socket_reader, kept for comparison.
+char * byte_read_line(sock s)
+{
+    char buffer[1024];
+    int ptr = 0;
+    char c = socket_read(s);
+    while(c && ptr < 1023) {
+        if(c == '\n') {
+            break;
+        }
+        if(c != ' ' && c != '\r') {
+            buffer[ptr++] = c;
+        }
+        c = socket_read(s);
+    }
+    buffer[ptr] = '\0';
+    return strdup(buffer);
+}
+
+packet * byte_read_packet(sock s)
+{
+    packet * pkt = malloc(sizeof(packet));
+    char * line = byte_read_line(s);
+    sscanf(line, "--%63s", pkt->boundary);
+    free(line);
+    line = byte_read_line(s);
+    sscanf(line, "Content-Type:%127s", pkt->type);
+    free(line);
+    line = byte_read_line(s);
+    sscanf(line, "Content-Length:%ld", &pkt->size);
+    free(line);
+    free(byte_read_line(s));
+    pkt->payload = malloc(pkt->size + 1);
+    for(long i = 0; i < pkt->size; i++) {
+        pkt->payload[i] = socket_read(s);
+    }
+    pkt->payload[pkt->size] = '\0';
+    return pkt;
+}
+
+int valid(packet * p, int index, long size)
+{
+    if(p == NULL || p->size != size || strcmp(p->boundary, "frame") || strcmp(p->type, "image/jpeg")) {
+        return 0;
+    }
+    for(long k = 0; k < size; k++) {
+        if(p->payload[k] != (char)(index + k)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Packets per second, 0 if a packet came back wrong.
+double measure(int port, int buffered, int count, long size)
+{
+    reader_run run;
+    run.listener = socket_listen(port);
+    run.count = count;
+    run.size = size;
+    if(run.listener == SOCKET_INVALID) {
+        return 0;
+    }
+    thread * writer = thread_start(send_packets, &run);
+    sock s = socket_create("127.0.0.1", port);
+    socket_reader * r = buffered ? socket_reader_create(s, 0) : NULL;
+
+    int ok = 1;
+    double t0 = now();
+    for(int i = 0; i < count && ok; i++) {
+        packet * p = buffered ? read_packet(r) : byte_read_packet(s);
+        ok = valid(p, i, size);
+        if(p) free_packet(p);
+    }
+    double elapsed = now() - t0;
+    if(buffered && ok) {
+        packet * p = read_packet(r);
+        ok = p == NULL;
+        if(p) free_packet(p);
+    }
+
+    thread_join(writer);
+    thread_release(writer);
+    if(r) socket_reader_release(r);
+    socket_close(s);
+    socket_close_peer(run.listener);
+    return ok ? count / elapsed : 0;
+}
+
+int main(int argc, char ** argv)
+{
+    int port = argc > 1 ? atoi(argv[1]) : 18090;
+    static const long sizes[] = { 2000, 200000 };
+    int failed = 0;
+
+    printf("%10s %16s %16s\n", "payload", "byte reads/s", "socket_reader/s");
+    for(int i = 0; i < 2; i++) {
+        // The byte reader is slow enough that a few packets give its rate.
+        int byte_count = sizes[i] > 10000 ? 20 : 500;
+        double before = measure(port, 0, byte_count, sizes[i]);
+        double after = measure(port, 1, 2000, sizes[i]);
+        printf("%10ld %16.0f %16.0f\n", sizes[i], before, after);
+        if(before == 0 || after == 0) {
+            printf("  FAILED: bad packet or no loopback socket\n");
+            failed = 1;
+        }
+    }
+    return failed;
+}
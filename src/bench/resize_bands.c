@@ -0,0 +1,105 @@
+// Scaling of resizer_run_parallel with the band count, for the fixed point
+// path and the stb path. Every band count must give the pixels of
+// resizer_run: exactly on the fixed point path, within one level on the stb
+// path, whose region bounds are floats (480 / 720 is not exact).
+//
+//   resize_bands [max threads] [iterations]
+//
+// Max threads defaults to the CPU count. The pool has max threads - 1
+// workers plus the caller, so `bands` bands keep at most `bands` cores busy.
+
+#include "../resize.h"
+
+#include <stdio.h>
+#include <time.h>
+
+#define SRC_WIDTH 5120
+#define SRC_HEIGHT 1440
+#define DST_WIDTH 2560
+#define DST_HEIGHT 720
+
+double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+void fill(bitmap * b)
+{
+    uint32_t state = 12345;
+    for(int y = 0; y < b->height; y++) {
+        uint8_t * row = (uint8_t *) b->data + (size_t) y * b->stride;
+        for(int x = 0; x < b->width * BITMAP_BPP; x++) {
+            state = state * 1103515245 + 12345;
+            row[x] = ((x / 64 + y / 64) & 1) ? (state >> 16) & 0xff : (x + y) & 0xff;
+        }
+    }
+}
+
+int max_diff(bitmap * a, bitmap * b)
+{
+    int worst = 0;
+    for(int y = 0; y < a->height; y++) {
+        uint8_t * pa = (uint8_t *) a->data + (size_t) y * a->stride;
+        uint8_t * pb = (uint8_t *) b->data + (size_t) y * b->stride;
+        for(int x = 0; x < a->width * BITMAP_BPP; x++) {
+            int d = abs(pa[x] - pb[x]);
+            if(d > worst) worst = d;
+        }
+    }
+    return worst;
+}
+
+// Returns 0 when a band count changed the output.
+int sweep(const char * name, resizer * r, bitmap * src, workers * pool, int threads, int iterations, int tolerance)
+{
+    bitmap * reference = bitmap_create(DST_WIDTH, DST_HEIGHT);
+    bitmap * dst = bitmap_create(DST_WIDTH, DST_HEIGHT);
+    int ok = 1;
+    double base = 0;
+
+    resizer_run(r, src, reference);
+    printf("%s path, %dx%d -> %dx%d\n", name, SRC_WIDTH, SRC_HEIGHT, DST_WIDTH, DST_HEIGHT);
+    printf("%6s %10s %8s\n", "bands", "ms/frame", "speedup");
+    for(int bands = 1; bands <= threads; bands++) {
+        resizer_run_parallel(r, src, dst, pool, bands);
+        if(max_diff(reference, dst) > tolerance) {
+            printf("  FAILED: %d bands differ from resizer_run\n", bands);
+            ok = 0;
+        }
+        double t0 = now();
+        for(int i = 0; i < iterations; i++) {
+            resizer_run_parallel(r, src, dst, pool, bands);
+        }
+        double ms = (now() - t0) * 1000 / iterations;
+        if(bands == 1) base = ms;
+        printf("%6d %10.2f %7.2fx\n", bands, ms, base / ms);
+    }
+    bitmap_release(reference);
+    bitmap_release(dst);
+    return ok;
+}
+
+int main(int argc, char ** argv)
+{
+    int threads = argc > 1 ? atoi(argv[1]) : cpu_count();
+    int iterations = argc > 2 ? atoi(argv[2]) : 10;
+    if(threads < 1) threads = 1;
+
+    // workers_create(0) means one per CPU, keep at least one worker.
+    workers * pool = workers_create(threads > 1 ? threads - 1 : 1);
+    bitmap * src = bitmap_create(SRC_WIDTH, SRC_HEIGHT);
+    fill(src);
+
+    resizer * r = resizer_create(SRC_WIDTH, SRC_HEIGHT, DST_WIDTH, DST_HEIGHT, STBIR_FILTER_DEFAULT);
+    int ok = sweep("fixed point", r, src, pool, threads, iterations, 0);
+    r->fixed = 0;
+    ok = sweep("stb", r, src, pool, threads, iterations, 1) && ok;
+    r->fixed = 1;
+
+    resizer_release(r);
+    bitmap_release(src);
+    workers_release(pool);
+    return !ok;
+}
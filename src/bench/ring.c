@@ -0,0 +1,218 @@
+// Ping-pong round trips between two threads through the SPSC and MPMC
+// rings, against the mutex and condition variable handoff they replace.
+// Then 4 producers and 4 consumers share one MPMC ring and every item
+// must come out exactly once.
+//
+//   ring [round trips] [items per producer]
+
+#include "../threads.h"
+#include "../ring.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define PRODUCERS 4
+#define CONSUMERS 4
+
+// One item at a time each way, like a stage handing a frame to the next.
+typedef struct _handoff {
+    mutex * lock;
+    cond * changed;
+    void * item;
+} handoff;
+
+long trips;
+long items;
+
+spsc_ring * spsc_ping;
+spsc_ring * spsc_pong;
+mpmc_ring * mpmc_ping;
+mpmc_ring * mpmc_pong;
+handoff mutex_ping;
+handoff mutex_pong;
+
+mpmc_ring * shared;
+unsigned char * seen;
+
+double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+void handoff_init(handoff * h)
+{
+    h->lock = mutex_create();
+    h->changed = cond_create();
+    h->item = NULL;
+}
+
+void handoff_release(handoff * h)
+{
+    mutex_release(h->lock);
+    cond_release(h->changed);
+}
+
+void handoff_put(handoff * h, void * item)
+{
+    mutex_lock(h->lock);
+    while(h->item) cond_wait(h->changed, h->lock);
+    h->item = item;
+    cond_broadcast(h->changed);
+    mutex_unlock(h->lock);
+}
+
+void * handoff_get(handoff * h)
+{
+    mutex_lock(h->lock);
+    while(!h->item) cond_wait(h->changed, h->lock);
+    void * item = h->item;
+    h->item = NULL;
+    cond_broadcast(h->changed);
+    mutex_unlock(h->lock);
+    return item;
+}
+
+void spsc_echo(void * arg)
+{
+    for(long i = 0; i < trips; i++) {
+        void * item;
+        while(!(item = spsc_ring_pop(spsc_ping))) thread_yield();
+        while(!spsc_ring_push(spsc_pong, item)) thread_yield();
+    }
+}
+
+void mpmc_echo(void * arg)
+{
+    for(long i = 0; i < trips; i++) {
+        void * item;
+        while(!(item = mpmc_ring_pop(mpmc_ping))) thread_yield();
+        while(!mpmc_ring_push(mpmc_pong, item)) thread_yield();
+    }
+}
+
+void mutex_echo(void * arg)
+{
+    for(long i = 0; i < trips; i++) {
+        handoff_put(&mutex_pong, handoff_get(&mutex_ping));
+    }
+}
+
+// Returns the average round trip in seconds, or -1 if an item came back
+// wrong.
+double ping_spsc()
+{
+    thread * t = thread_start(spsc_echo, NULL);
+    double t0 = now();
+    for(long i = 1; i <= trips; i++) {
+        void * item;
+        while(!spsc_ring_push(spsc_ping, (void *)(intptr_t) i)) thread_yield();
+        while(!(item = spsc_ring_pop(spsc_pong))) thread_yield();
+        if((intptr_t) item != i) return -1;
+    }
+    double elapsed = now() - t0;
+    thread_join(t);
+    return elapsed / trips;
+}
+
+double ping_mpmc()
+{
+    thread * t = thread_start(mpmc_echo, NULL);
+    double t0 = now();
+    for(long i = 1; i <= trips; i++) {
+        void * item;
+        while(!mpmc_ring_push(mpmc_ping, (void *)(intptr_t) i)) thread_yield();
+        while(!(item = mpmc_ring_pop(mpmc_pong))) thread_yield();
+        if((intptr_t) item != i) return -1;
+    }
+    double elapsed = now() - t0;
+    thread_join(t);
+    return elapsed / trips;
+}
+
+double ping_mutex()
+{
+    thread * t = thread_start(mutex_echo, NULL);
+    double t0 = now();
+    for(long i = 1; i <= trips; i++) {
+        handoff_put(&mutex_ping, (void *)(intptr_t) i);
+        if((intptr_t) handoff_get(&mutex_pong) != i) return -1;
+    }
+    double elapsed = now() - t0;
+    thread_join(t);
+    return elapsed / trips;
+}
+
+// Items are 1 + producer * items + sequence, so none is NULL and each
+// names its own slot in seen.
+void produce(void * arg)
+{
+    long first = 1 + (intptr_t) arg * items;
+    for(long i = 0; i < items; i++) {
+        while(!mpmc_ring_push(shared, (void *)(intptr_t)(first + i))) thread_yield();
+    }
+}
+
+void consume(void * arg)
+{
+    for(long i = 0; i < items * PRODUCERS / CONSUMERS; i++) {
+        void * item;
+        while(!(item = mpmc_ring_pop(shared))) thread_yield();
+        __atomic_add_fetch(&seen[(intptr_t) item - 1], 1, __ATOMIC_RELAXED);
+    }
+}
+
+int exactly_once()
+{
+    thread * t[PRODUCERS + CONSUMERS];
+    for(int i = 0; i < PRODUCERS; i++) t[i] = thread_start(produce, (void *)(intptr_t) i);
+    for(int i = 0; i < CONSUMERS; i++) t[PRODUCERS + i] = thread_start(consume, NULL);
+    for(int i = 0; i < PRODUCERS + CONSUMERS; i++) thread_join(t[i]);
+
+    if(mpmc_ring_pop(shared)) return 0;
+    for(long i = 0; i < items * PRODUCERS; i++) {
+        if(seen[i] != 1) return 0;
+    }
+    return 1;
+}
+
+int main(int argc, char ** argv)
+{
+    trips = argc > 1 ? atol(argv[1]) : 200000;
+    items = argc > 2 ? atol(argv[2]) : 200000;
+    int failed = 0;
+
+    spsc_ping = spsc_ring_create(16);
+    spsc_pong = spsc_ring_create(16);
+    mpmc_ping = mpmc_ring_create(16);
+    mpmc_pong = mpmc_ring_create(16);
+    handoff_init(&mutex_ping);
+    handoff_init(&mutex_pong);
+
+    double spsc = ping_spsc();
+    double mpmc = ping_mpmc();
+    double locked = ping_mutex();
+    failed |= spsc < 0 || mpmc < 0 || locked < 0;
+    printf("round trip: spsc %.2f us, mpmc %.2f us, mutex + cond %.2f us\n",
+           spsc * 1e6, mpmc * 1e6, locked * 1e6);
+
+    shared = mpmc_ring_create(64);
+    seen = calloc(items * PRODUCERS, 1);
+    int once = exactly_once();
+    failed |= !once;
+    printf("mpmc %dP/%dC, %ld items: %s\n", PRODUCERS, CONSUMERS, items * PRODUCERS,
+           once ? "each delivered exactly once" : "FAILED: lost or duplicated items");
+
+    free(seen);
+    mpmc_ring_release(shared);
+    handoff_release(&mutex_ping);
+    handoff_release(&mutex_pong);
+    mpmc_ring_release(mpmc_ping);
+    mpmc_ring_release(mpmc_pong);
+    spsc_ring_release(spsc_ping);
+    spsc_ring_release(spsc_pong);
+    return failed;
+}
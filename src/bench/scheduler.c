@@ -0,0 +1,153 @@
+// Work-stealing scheduler against a single locked queue (the task pool),
+// on frames of SCREENS screens split into SLICES slices each, where one
+// screen is busy video and the others are nearly static. The scheduler
+// runs it nested (a job per screen fanning out into a job per slice), the
+// pool gets the slices flattened since its tasks can't wait on it. Also
+// times tiny jobs to show the per-job cost. Every slice must run exactly
+// once per frame.
+//
+//   scheduler [threads] [work] [frames]
+
+#include "../threads.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define SCREENS 4
+#define SLICES 64
+#define TINY_JOBS 200000
+
+typedef struct _slice {
+    int screen;
+    int index;
+} slice;
+
+scheduler * slices_scheduler;
+long work;
+long runs[SCREENS][SLICES];
+long tiny_runs;
+
+double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+long spin(long n)
+{
+    volatile long x = 0;
+    for(long i = 0; i < n; i++) x += i;
+    return x;
+}
+
+// Screen 0 costs 50 to 200 times more per slice than the others.
+void run_slice(int screen, int index)
+{
+    spin(screen == 0 ? work * (1 + index % 4) : work / 50);
+    __atomic_add_fetch(&runs[screen][index], 1, __ATOMIC_RELAXED);
+}
+
+void slice_job(void * arg, int index)
+{
+    run_slice((int)(intptr_t) arg, index);
+}
+
+void screen_job(void * arg, int screen)
+{
+    scheduler_run(slices_scheduler, slice_job, (void *)(intptr_t) screen, SLICES);
+}
+
+void * slice_task(void * arg)
+{
+    slice * s = arg;
+    run_slice(s->screen, s->index);
+    return NULL;
+}
+
+void tiny_job(void * arg, int index)
+{
+    __atomic_add_fetch(&tiny_runs, 1, __ATOMIC_RELAXED);
+}
+
+void * tiny_task(void * arg)
+{
+    __atomic_add_fetch(&tiny_runs, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+int check(long frames)
+{
+    for(int s = 0; s < SCREENS; s++) {
+        for(int i = 0; i < SLICES; i++) {
+            if(runs[s][i] != frames) return 0;
+        }
+    }
+    return 1;
+}
+
+int main(int argc, char ** argv)
+{
+    int threads = argc > 1 ? atoi(argv[1]) : cpu_count();
+    work = argc > 2 ? atol(argv[2]) : 20000;
+    int frames = argc > 3 ? atoi(argv[3]) : 50;
+    if(threads < 2) threads = 2;
+    int failed = 0;
+
+    // Same number of threads working on both: the scheduler's caller
+    // helps, the pool's doesn't.
+    slices_scheduler = scheduler_create(threads - 1);
+    pool * queue = pool_create(threads, SCREENS * SLICES);
+
+    double t0 = now();
+    for(int f = 0; f < frames; f++) {
+        scheduler_run(slices_scheduler, screen_job, NULL, SCREENS);
+    }
+    double stealing = (now() - t0) / frames;
+    failed |= !check(frames);
+    memset(runs, 0, sizeof(runs));
+
+    slice tasks[SCREENS * SLICES];
+    future * done[SCREENS * SLICES];
+    t0 = now();
+    for(int f = 0; f < frames; f++) {
+        for(int i = 0; i < SCREENS * SLICES; i++) {
+            tasks[i].screen = i / SLICES;
+            tasks[i].index = i % SLICES;
+            done[i] = pool_submit(queue, slice_task, &tasks[i]);
+        }
+        for(int i = 0; i < SCREENS * SLICES; i++) {
+            future_wait(queue, done[i]);
+        }
+    }
+    double locked = (now() - t0) / frames;
+    failed |= !check(frames);
+
+    printf("%d threads, %dx%d slices, skewed: work-stealing %.2f ms/frame, locked queue %.2f ms/frame\n",
+           threads, SCREENS, SLICES, stealing * 1e3, locked * 1e3);
+
+    t0 = now();
+    for(int r = 0; r < TINY_JOBS / 1000; r++) {
+        scheduler_run(slices_scheduler, tiny_job, NULL, 1000);
+    }
+    stealing = (now() - t0) / TINY_JOBS;
+    failed |= tiny_runs != TINY_JOBS;
+
+    t0 = now();
+    for(int r = 0; r < TINY_JOBS; r++) {
+        pool_post(queue, tiny_task, NULL);
+    }
+    pool_release(queue);
+    locked = (now() - t0) / TINY_JOBS;
+    failed |= tiny_runs != 2 * TINY_JOBS;
+
+    printf("tiny jobs: work-stealing %.3f us/job, locked queue %.3f us/job\n", stealing * 1e6, locked * 1e6);
+    if(failed) {
+        printf("FAILED: a job did not run exactly once\n");
+    }
+
+    scheduler_release(slices_scheduler);
+    return failed;
+}
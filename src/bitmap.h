@@ -0,0 +1,93 @@
+#ifndef __BITMAP_H__
+#define __BITMAP_H__
+
+#include <stdlib.h>
+
+// 32 bits per pixel, BGRX byte order (X11 ZPixmap / Windows DIB layout).
+#define BITMAP_BPP 4
+
+typedef struct _bitmap {
+    int width;
+    int height;
+    int stride;
+    char * data;
+} bitmap;
+
+typedef struct _rect {
+    int x;
+    int y;
+    int width;
+    int height;
+} rect;
+
+// Dirty regions of a bitmap, in bitmap coordinates.
+typedef struct _rects {
+    int count;
+    int capacity;
+    rect * list;
+} rects;
+
+
+bitmap * bitmap_create(int width, int height);
+
+void bitmap_release(bitmap * b);
+
+rects * rects_create(int capacity);
+
+void rects_clear(rects * r);
+
+void rects_add(rects * r, int x, int y, int width, int height);
+
+void rects_release(rects * r);
+
+
+bitmap * bitmap_create(int width, int height)
+{
+    bitmap * b = malloc(sizeof(bitmap));
+    b->width = width;
+    b->height = height;
+    b->stride = width * BITMAP_BPP;
+    b->data = malloc((size_t)b->stride * height);
+    return b;
+}
+
+void bitmap_release(bitmap * b)
+{
+    free(b->data);
+    free(b);
+}
+
+rects * rects_create(int capacity)
+{
+    rects * r = malloc(sizeof(rects));
+    r->count = 0;
+    r->capacity = capacity > 0 ? capacity : 16;
+    r->list = malloc(r->capacity * sizeof(rect));
+    return r;
+}
+
+void rects_clear(rects * r)
+{
+    r->count = 0;
+}
+
+void rects_add(rects * r, int x, int y, int width, int height)
+{
+    if(r->count == r->capacity) {
+        r->capacity *= 2;
+        r->list = realloc(r->list, r->capacity * sizeof(rect));
+    }
+    r->list[r->count].x = x;
+    r->list[r->count].y = y;
+    r->list[r->count].width = width;
+    r->list[r->count].height = height;
+    r->count++;
+}
+
+void rects_release(rects * r)
+{
+    free(r->list);
+    free(r);
+}
+
+#endif
@@ -8,7 +8,11 @@
  *
  * Features
  *  - Implements Baseline DCT JPEG compression.
- *  - No dynamic allocations.
+ *  - 4:4:4, 4:2:2 and 4:2:0 chroma subsampling.
+ *  - Restart markers, with slices optionally encoded in parallel.
+ *  - Fixed-point color conversion, AVX2 DCT and color kernels.
+ *  - Allocates only a one MCU row color conversion strip, plus one output
+ *    buffer per slice when encoding slices in parallel.
  *
  * This library is coded in the spirit of the stb libraries and mostly follows
  * the stb guidelines.
@@ -97,6 +101,8 @@ extern "C"
 #ifndef TJE_HEADER_GUARD
 #define TJE_HEADER_GUARD
 
+#include <stddef.h>  // size_t
+
 // - tje_encode_to_file -
 //
 // Usage:
@@ -148,17 +154,135 @@ int tje_encode_to_file_at_quality(const char* dest_path,
 //  how to handle (or ignore) `context`. The callback receives an array `data`
 //  of `size` bytes, which can be written directly to a file. There is no need
 //  to free the data.
+//
+//  sampling:           Chroma subsampling, one of the TJE_SAMPLING_ values
+//                      below. 4:2:0 encodes half as many blocks as 4:4:4.
+//  format:             Pixel layout, one of the TJE_FORMAT_ values below.
+//                      3 and 4 keep their num_components meaning (RGB, RGBA).
+//  stride:             Bytes from one row to the next, 0 for tightly packed
+//                      rows. Lets captured frames be encoded in place.
+
+enum
+{
+    TJE_SAMPLING_444 = 0,  // Full resolution chroma.
+    TJE_SAMPLING_422 = 1,  // Chroma halved horizontally. 16x8 MCUs.
+    TJE_SAMPLING_420 = 2,  // Chroma halved in both directions. 16x16 MCUs.
+};
+
+enum
+{
+    TJE_FORMAT_RGB  = 3,
+    TJE_FORMAT_RGBA = 4,
+    TJE_FORMAT_RGBX = 5,
+    TJE_FORMAT_BGRA = 6,
+    TJE_FORMAT_BGRX = 7,  // X11 and Windows screen captures.
+};
 
 typedef void tje_write_func(void* context, void* data, int size);
 
 int tje_encode_with_func(tje_write_func* func,
                          void* context,
                          const int quality,
+                         const int sampling,
                          const int width,
                          const int height,
-                         const int num_components,
+                         const int format,
+                         const int stride,
                          const unsigned char* src_data);
 
+// - tje_encode_sliced_with_func -
+//
+// Usage
+//  Same as tje_encode_with_func, but the scan is cut into slices of
+//  `slice_rows` MCU rows separated by restart markers (DRI/RSTn). Slices share
+//  no state, so when `parallel` is not NULL they are encoded concurrently:
+//  the encoder calls parallel(parallel_context, job, arg, count), which must
+//  run job(arg, i) for every i in [0, count) and return once all of them are
+//  done. Encoding slices in parallel allocates one output buffer per slice.
+
+typedef void tje_job_func(void* arg, int index);
+
+typedef void tje_parallel_func(void* context, tje_job_func* job, void* arg, int count);
+
+int tje_encode_sliced_with_func(tje_write_func* func,
+                                void* context,
+                                tje_parallel_func* parallel,
+                                void* parallel_context,
+                                const int slice_rows,
+                                const int quality,
+                                const int sampling,
+                                const int width,
+                                const int height,
+                                const int format,
+                                const int stride,
+                                const unsigned char* src_data);
+
+// - tje_encoder -
+//
+// Usage
+//  For a stream of frames with the same size, layout and quality. Tables and
+//  headers are built once by tje_encoder_create, so tje_encoder_encode only
+//  does the per-frame work. Parameters are the ones of
+//  tje_encode_sliced_with_func. tje_encoder_create returns NULL when they are
+//  invalid. An encoder must not encode two frames at the same time.
+
+typedef struct TJEEncoder tje_encoder;
+
+tje_encoder* tje_encoder_create(const int quality,
+                                const int sampling,
+                                const int width,
+                                const int height,
+                                const int format,
+                                const int stride,
+                                const int slice_rows,
+                                tje_parallel_func* parallel,
+                                void* parallel_context);
+
+int tje_encoder_encode(tje_encoder* encoder,
+                       tje_write_func* func,
+                       void* context,
+                       const unsigned char* src_data);
+
+void tje_encoder_release(tje_encoder* encoder);
+
+// - tje_encoder_encode_to_memory -
+//
+// Usage
+//  Like tje_encoder_encode, but the JPEG is written straight into *buffer at
+//  `offset` with no intermediate copy. The first `offset` bytes are left
+//  alone, so callers can reserve room for their own headers. *buffer (NULL
+//  or from malloc) is grown with realloc as needed and *capacity updated, so
+//  reusing the same buffer for every frame stops allocating after the
+//  first few. Returns the size of the JPEG, 0 on failure.
+
+size_t tje_encoder_encode_to_memory(tje_encoder* encoder,
+                                    unsigned char** buffer,
+                                    size_t* capacity,
+                                    const size_t offset,
+                                    const unsigned char* src_data);
+
+// - tje_encoder_optimize_huffman -
+//
+// Usage
+//  Replaces the standard Huffman tables with tables built from the symbol
+//  statistics of the frame being encoded, which costs a second pass over
+//  that frame. The tables are then reused for the next `frames` - 1 frames
+//  without a second pass. 0 goes back to the standard tables.
+
+void tje_encoder_optimize_huffman(tje_encoder* encoder, const int frames);
+
+// - tje_encoder_cache_blocks -
+//
+// Usage
+//  For mostly static content such as desktops. Keeps the quantized
+//  coefficients of every MCU along with a hash of its pixels. When an MCU
+//  hashes the same as in the previous frame, color conversion, DCT and
+//  quantization are skipped and only Huffman coding runs again. Costs about
+//  130 bytes per 8x8 block of the frame. Returns 0 if that memory can't be
+//  allocated.
+
+int tje_encoder_cache_blocks(tje_encoder* encoder, const int enable);
+
 #endif // TJE_HEADER_GUARD
 
 
@@ -186,11 +310,21 @@ int tje_encode_with_func(tje_write_func* func,
 // Only use zero for debugging and/or inspection.
 #define TJE_USE_FAST_DCT 1
 
+// AVX2 DCT and quantization, picked at run time when the CPU supports it.
+// Define TJE_NO_SIMD to always use the scalar code.
+#if TJE_USE_FAST_DCT && !defined(TJE_NO_SIMD) && (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define TJEI_AVX2 1
+#define TJEI_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
 // C std lib
 #include <assert.h>
 #include <inttypes.h>
 #include <math.h>   // floorf, ceilf
 #include <stdio.h>  // FILE, puts
+#include <stdlib.h> // realloc, free
 #include <string.h> // memcpy
 
 
@@ -240,14 +374,89 @@ typedef struct
     uint8_t         qt_luma[64];
     uint8_t         qt_chroma[64];
 
+    // Luma sampling factors. Chroma is always 1x1.
+    int             h_factor;
+    int             v_factor;
+
+    // Use the AVX2 kernels, see tjei_fdct_quantize_avx2.
+    int             use_avx2;
+
+    // Source layout, see TJE_FORMAT_.
+    int             bytes_per_pixel;
+    size_t          stride;
+
+    // Fixed-point RGB to YCbCr matrix, indexed by output component and by
+    // byte offset in the source pixel. See tjei_setup_ycc.
+    int16_t         ycc_coeffs[3][4];
+
+    // MCU rows per restart interval, 0 for a single interval.
+    int                 restart_rows;
+    tje_parallel_func*  parallel;
+    void*               parallel_context;
+
+    // Set up by tjei_plan_slices.
+    int             mcu_rows;
+    int             mcus_per_row;
+    int             slice_rows;
+    int             num_slices;
+
+    // Color conversion strip owned by the caller, NULL to allocate one in
+    // each tjei_encode_mcu_rows call.
+    float*          strip;
+
+    // When not NULL, the scan only counts Huffman symbols into freq[table]
+    // and writes nothing. See tjei_huff_optimize.
+    uint32_t        (*freq)[256];
+
+    // Coefficients of unchanged MCUs are taken from here instead of being
+    // computed again. See tje_encoder_cache_blocks.
+    struct TJEIBlockCache* cache;
+
     // fwrite by default. User-defined when using tje_encode_with_func.
     TJEWriteContext write_context;
 
+    // When not NULL, output is appended here directly instead of going
+    // through output_buffer and write_context.
+    struct TJEIBuffer* sink;
+
     // Buffered output. Big performance win when using the usual stdlib implementations.
     size_t          output_buffer_count;
     uint8_t         output_buffer[TJEI_BUFFER_SIZE];
 } TJEState;
 
+// Growable output in memory: encoded slices, the encoder's header and
+// tje_encoder_encode_to_memory.
+typedef struct TJEIBuffer
+{
+    uint8_t* data;
+    size_t   size;
+    size_t   capacity;
+    int      failed;
+    uint32_t freq[4][256];  // Symbol counts of a slice, when counting.
+} TJEIBuffer;
+
+static void tjei_buffer_append(TJEIBuffer* buffer, const void* data, size_t size)
+{
+    if (buffer->failed) {
+        return;
+    }
+    if (buffer->size + size > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity * 2 : 4 * TJEI_BUFFER_SIZE;
+        while (capacity < buffer->size + size) {
+            capacity *= 2;
+        }
+        uint8_t* grown = (uint8_t*)realloc(buffer->data, capacity);
+        if (!grown) {
+            buffer->failed = 1;
+            return;
+        }
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+}
+
 // ============================================================
 // Table definitions.
 //
@@ -470,6 +679,11 @@ static void tjei_write(TJEState* state, const void* data, size_t num_bytes, size
 {
     size_t to_write = num_bytes * num_elements;
 
+    if (state->sink) {
+        tjei_buffer_append(state->sink, data, to_write);
+        return;
+    }
+
     // Cap to the buffer available size and copy memory.
     size_t capped_count = tjei_min(to_write, TJEI_BUFFER_SIZE - 1 - state->output_buffer_count);
 
@@ -778,50 +992,219 @@ static float slow_fdct(int u, int v, float* data)
 
 #define ABS(x) ((x) < 0 ? -(x) : (x))
 
-static void tjei_encode_and_write_MCU(TJEState* state,
-                                      float* mcu,
+#if TJEI_AVX2
+// Natural order index of each zig-zag position, the inverse of tjei_zig_zag.
+static const int32_t tjei_zig_zag_inverse[64] =
+{
+    0,  1,  8, 16,  9,  2,  3, 10,
+   17, 24, 32, 25, 18, 11,  4,  5,
+   12, 19, 26, 33, 40, 48, 41, 34,
+   27, 20, 13,  6,  7, 14, 21, 28,
+   35, 42, 49, 56, 57, 50, 43, 36,
+   29, 22, 15, 23, 30, 37, 44, 51,
+   58, 59, 52, 45, 38, 31, 39, 46,
+   53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+// Encoders may be created from several threads at once.
+static int tjei_cpu_has_avx2(void)
+{
+    static int tjei_avx2 = -1;
+    int has = __atomic_load_n(&tjei_avx2, __ATOMIC_RELAXED);
+    if (has < 0) {
+        __builtin_cpu_init();
+        has = __builtin_cpu_supports("avx2") ? 1 : 0;
+        __atomic_store_n(&tjei_avx2, has, __ATOMIC_RELAXED);
+    }
+    return has;
+}
+
+TJEI_TARGET_AVX2
+static inline void tjei_transpose_avx2(__m256 d[8])
+{
+    __m256 t0 = _mm256_unpacklo_ps(d[0], d[1]);
+    __m256 t1 = _mm256_unpackhi_ps(d[0], d[1]);
+    __m256 t2 = _mm256_unpacklo_ps(d[2], d[3]);
+    __m256 t3 = _mm256_unpackhi_ps(d[2], d[3]);
+    __m256 t4 = _mm256_unpacklo_ps(d[4], d[5]);
+    __m256 t5 = _mm256_unpackhi_ps(d[4], d[5]);
+    __m256 t6 = _mm256_unpacklo_ps(d[6], d[7]);
+    __m256 t7 = _mm256_unpackhi_ps(d[6], d[7]);
+    __m256 s0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+    d[0] = _mm256_permute2f128_ps(s0, s4, 0x20);
+    d[1] = _mm256_permute2f128_ps(s1, s5, 0x20);
+    d[2] = _mm256_permute2f128_ps(s2, s6, 0x20);
+    d[3] = _mm256_permute2f128_ps(s3, s7, 0x20);
+    d[4] = _mm256_permute2f128_ps(s0, s4, 0x31);
+    d[5] = _mm256_permute2f128_ps(s1, s5, 0x31);
+    d[6] = _mm256_permute2f128_ps(s2, s6, 0x31);
+    d[7] = _mm256_permute2f128_ps(s3, s7, 0x31);
+}
+
+// One pass of tjei_fdct over eight lanes at once: d[k] holds element k of
+// eight independent 1-D transforms. Same operations in the same order as the
+// scalar code, so the results are bit-identical.
+TJEI_TARGET_AVX2
+static inline void tjei_fdct_pass_avx2(__m256 d[8])
+{
+    const __m256 c4 = _mm256_set1_ps(0.707106781f);
+    const __m256 c6 = _mm256_set1_ps(0.382683433f);
+    const __m256 c2_c6 = _mm256_set1_ps(0.541196100f);
+    const __m256 c2c6 = _mm256_set1_ps(1.306562965f);
+
+    __m256 tmp0 = _mm256_add_ps(d[0], d[7]);
+    __m256 tmp7 = _mm256_sub_ps(d[0], d[7]);
+    __m256 tmp1 = _mm256_add_ps(d[1], d[6]);
+    __m256 tmp6 = _mm256_sub_ps(d[1], d[6]);
+    __m256 tmp2 = _mm256_add_ps(d[2], d[5]);
+    __m256 tmp5 = _mm256_sub_ps(d[2], d[5]);
+    __m256 tmp3 = _mm256_add_ps(d[3], d[4]);
+    __m256 tmp4 = _mm256_sub_ps(d[3], d[4]);
+
+    // Even part
+    __m256 tmp10 = _mm256_add_ps(tmp0, tmp3);
+    __m256 tmp13 = _mm256_sub_ps(tmp0, tmp3);
+    __m256 tmp11 = _mm256_add_ps(tmp1, tmp2);
+    __m256 tmp12 = _mm256_sub_ps(tmp1, tmp2);
+
+    d[0] = _mm256_add_ps(tmp10, tmp11);
+    d[4] = _mm256_sub_ps(tmp10, tmp11);
+
+    __m256 z1 = _mm256_mul_ps(_mm256_add_ps(tmp12, tmp13), c4);
+    d[2] = _mm256_add_ps(tmp13, z1);
+    d[6] = _mm256_sub_ps(tmp13, z1);
+
+    // Odd part
+    tmp10 = _mm256_add_ps(tmp4, tmp5);
+    tmp11 = _mm256_add_ps(tmp5, tmp6);
+    tmp12 = _mm256_add_ps(tmp6, tmp7);
+
+    __m256 z5 = _mm256_mul_ps(_mm256_sub_ps(tmp10, tmp12), c6);
+    __m256 z2 = _mm256_add_ps(_mm256_mul_ps(c2_c6, tmp10), z5);
+    __m256 z4 = _mm256_add_ps(_mm256_mul_ps(c2c6, tmp12), z5);
+    __m256 z3 = _mm256_mul_ps(tmp11, c4);
+
+    __m256 z11 = _mm256_add_ps(tmp7, z3);
+    __m256 z13 = _mm256_sub_ps(tmp7, z3);
+
+    d[5] = _mm256_add_ps(z13, z2);
+    d[3] = _mm256_sub_ps(z13, z2);
+    d[1] = _mm256_add_ps(z11, z4);
+    d[7] = _mm256_sub_ps(z11, z4);
+}
+
+// tjei_fdct, quantization and zig-zag reordering of one block, kept in
+// registers throughout. `du` receives the coefficients in zig-zag order.
+TJEI_TARGET_AVX2
+static void tjei_fdct_quantize_avx2(const float* mcu, const float* qt, int* du)
+{
+    __m256 d[8];
+    for ( int i = 0; i < 8; ++i ) {
+        d[i] = _mm256_loadu_ps(mcu + 8 * i);
+    }
+
+    // Rows: transposed so that each vector holds one column position.
+    tjei_transpose_avx2(d);
+    tjei_fdct_pass_avx2(d);
+    // Columns: back to one row per vector.
+    tjei_transpose_avx2(d);
+    tjei_fdct_pass_avx2(d);
+
+    const __m256 bias = _mm256_set1_ps(1024.0f);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    int32_t quantized[64];
+    for ( int i = 0; i < 8; ++i ) {
+        __m256 v = _mm256_mul_ps(d[i], _mm256_loadu_ps(qt + 8 * i));
+        v = _mm256_floor_ps(_mm256_add_ps(_mm256_add_ps(v, bias), half));
+        v = _mm256_sub_ps(v, bias);
+        _mm256_storeu_si256((__m256i*)(quantized + 8 * i), _mm256_cvttps_epi32(v));
+    }
+    for ( int i = 0; i < 8; ++i ) {
+        __m256i index = _mm256_loadu_si256((const __m256i*)(tjei_zig_zag_inverse + 8 * i));
+        _mm256_storeu_si256((__m256i*)(du + 8 * i), _mm256_i32gather_epi32(quantized, index, 4));
+    }
+}
+#endif  // TJEI_AVX2
+
+enum {
+    TJEI_LUMA_DC,
+    TJEI_LUMA_AC,
+    TJEI_CHROMA_DC,
+    TJEI_CHROMA_AC,
+};
+
+// DCT and quantization of one block. `du` receives the coefficients in
+// zig-zag order.
+static void tjei_quantize_MCU(const TJEState* state,
+                              float* mcu,
 #if TJE_USE_FAST_DCT
-                                      float* qt,  // Pre-processed quantization matrix.
+                              float* qt,  // Pre-processed quantization matrix.
 #else
-                                      uint8_t* qt,
+                              uint8_t* qt,
 #endif
-                                      uint8_t* huff_dc_len, uint16_t* huff_dc_code, // Huffman tables
-                                      uint8_t* huff_ac_len, uint16_t* huff_ac_code,
-                                      int* pred,  // Previous DC coefficient
-                                      uint32_t* bitbuffer,  // Bitstack.
-                                      uint32_t* location)
+                              int* du)
 {
-    int du[64];  // Data unit in zig-zag order
+#if !TJEI_AVX2
+    (void)state;
+#endif
 
-    float dct_mcu[64];
-    memcpy(dct_mcu, mcu, 64 * sizeof(float));
+#if TJEI_AVX2
+    if (state->use_avx2) {
+        tjei_fdct_quantize_avx2(mcu, qt, du);
+    } else
+#endif
+    {
+        float dct_mcu[64];
+        memcpy(dct_mcu, mcu, 64 * sizeof(float));
 
 #if TJE_USE_FAST_DCT
-    tjei_fdct(dct_mcu);
-    for ( int i = 0; i < 64; ++i ) {
-        float fval = dct_mcu[i];
-        fval *= qt[i];
+        tjei_fdct(dct_mcu);
+        for ( int i = 0; i < 64; ++i ) {
+            float fval = dct_mcu[i];
+            fval *= qt[i];
 #if 0
-        fval = (fval > 0) ? floorf(fval + 0.5f) : ceilf(fval - 0.5f);
+            fval = (fval > 0) ? floorf(fval + 0.5f) : ceilf(fval - 0.5f);
 #else
-        fval = floorf(fval + 1024 + 0.5f);
-        fval -= 1024;
+            fval = floorf(fval + 1024 + 0.5f);
+            fval -= 1024;
 #endif
-        int val = (int)fval;
-        du[tjei_zig_zag[i]] = val;
-    }
+            int val = (int)fval;
+            du[tjei_zig_zag[i]] = val;
+        }
 #else
-    for ( int v = 0; v < 8; ++v ) {
-        for ( int u = 0; u < 8; ++u ) {
-            dct_mcu[v * 8 + u] = slow_fdct(u, v, mcu);
+        for ( int v = 0; v < 8; ++v ) {
+            for ( int u = 0; u < 8; ++u ) {
+                dct_mcu[v * 8 + u] = slow_fdct(u, v, mcu);
+            }
+        }
+        for ( int i = 0; i < 64; ++i ) {
+            float fval = dct_mcu[i] / (qt[i]);
+            int val = (int)((fval > 0) ? floorf(fval + 0.5f) : ceilf(fval - 0.5f));
+            du[tjei_zig_zag[i]] = val;
         }
-    }
-    for ( int i = 0; i < 64; ++i ) {
-        float fval = dct_mcu[i] / (qt[i]);
-        int val = (int)((fval > 0) ? floorf(fval + 0.5f) : ceilf(fval - 0.5f));
-        du[tjei_zig_zag[i]] = val;
-    }
 #endif
+    }
+}
+
+// Huffman coding of one block of quantized coefficients.
+static void tjei_write_MCU(TJEState* state,
+                           const int* du,
+                           int dc_table, int ac_table,  // Huffman tables, TJEI_LUMA_DC...
+                           int* pred,  // Previous DC coefficient
+                           uint32_t* bitbuffer,  // Bitstack.
+                           uint32_t* location)
+{
+    const uint8_t* huff_dc_len = state->ehuffsize[dc_table];
+    const uint16_t* huff_dc_code = state->ehuffcode[dc_table];
+    const uint8_t* huff_ac_len = state->ehuffsize[ac_table];
+    const uint16_t* huff_ac_code = state->ehuffcode[ac_table];
 
     uint16_t vli[2];
 
@@ -880,29 +1263,72 @@ static void tjei_encode_and_write_MCU(TJEState* state,
         // write EOB HUFF(00,00)
         tjei_write_bits(state, bitbuffer, location, huff_ac_len[0], huff_ac_code[0]);
     }
-    return;
 }
 
-enum {
-    TJEI_LUMA_DC,
-    TJEI_LUMA_AC,
-    TJEI_CHROMA_DC,
-    TJEI_CHROMA_AC,
-};
+// Same walk over the coefficients as tjei_write_MCU, counting the Huffman
+// symbols instead of writing them.
+static void tjei_count_MCU(const int* du, uint32_t* dc_freq, uint32_t* ac_freq, int* pred)
+{
+    uint16_t vli[2];
+
+    int diff = du[0] - *pred;
+    *pred = du[0];
+    if ( diff != 0 ) {
+        tjei_calculate_variable_length_int(diff, vli);
+        ++dc_freq[vli[1]];
+    } else {
+        ++dc_freq[0];
+    }
+
+    int last_non_zero_i = 0;
+    for ( int i = 63; i > 0; --i ) {
+        if (du[i] != 0) {
+            last_non_zero_i = i;
+            break;
+        }
+    }
+
+    for ( int i = 1; i <= last_non_zero_i; ++i ) {
+        int zero_count = 0;
+        while ( du[i] == 0 ) {
+            ++zero_count;
+            ++i;
+            if (zero_count == 16) {
+                ++ac_freq[0xf0];
+                zero_count = 0;
+            }
+        }
+        tjei_calculate_variable_length_int(du[i], vli);
+        ++ac_freq[(zero_count << 4) | vli[1]];
+    }
+
+    if (last_non_zero_i != 63) {
+        ++ac_freq[0x00];
+    }
+}
+
+static void tjei_code_MCU(TJEState* state,
+                          const int* du,
+                          int dc_table, int ac_table,  // Huffman tables, TJEI_LUMA_DC...
+                          int* pred,  // Previous DC coefficient
+                          uint32_t* bitbuffer,  // Bitstack.
+                          uint32_t* location)
+{
+    if (state->freq) {
+        tjei_count_MCU(du, state->freq[dc_table], state->freq[ac_table], pred);
+    } else {
+        tjei_write_MCU(state, du, dc_table, ac_table, pred, bitbuffer, location);
+    }
+}
 
-#if TJE_USE_FAST_DCT
 struct TJEProcessedQT
 {
     float chroma[64];
     float luma[64];
 };
-#endif
 
-// Set up huffman tables in state.
-static void tjei_huff_expand(TJEState* state)
+static void tjei_huff_default(TJEState* state)
 {
-    assert(state);
-
     state->ht_bits[TJEI_LUMA_DC]   = tjei_default_ht_luma_dc_len;
     state->ht_bits[TJEI_LUMA_AC]   = tjei_default_ht_luma_ac_len;
     state->ht_bits[TJEI_CHROMA_DC] = tjei_default_ht_chroma_dc_len;
@@ -912,6 +1338,115 @@ static void tjei_huff_expand(TJEState* state)
     state->ht_vals[TJEI_LUMA_AC]   = tjei_default_ht_luma_ac;
     state->ht_vals[TJEI_CHROMA_DC] = tjei_default_ht_chroma_dc;
     state->ht_vals[TJEI_CHROMA_AC] = tjei_default_ht_chroma_ac;
+}
+
+// Builds an optimal table for the symbol counts in `freq` (Annex K.2 with
+// the code lengths limited to 16 bits). Every valid symbol of the table class
+// gets a code, even unseen ones, so that the table can be reused for frames
+// it was not built from.
+static void tjei_huff_optimize(const uint32_t freq_in[256], int is_ac, uint8_t bits[16], uint8_t vals[256])
+{
+    uint32_t freq[257];
+    int codesize[257];
+    int others[257];
+    int bitcount[33] = { 0 };
+
+    for ( int i = 0; i < 256; ++i ) {
+        int run = i >> 4;
+        int size = i & 0x0f;
+        int valid = is_ac ? (size >= 1 && size <= 10) || i == 0x00 || i == 0xf0
+                          : (run == 0 && size <= 11);
+        freq[i] = valid ? freq_in[i] + 1 : 0;
+        codesize[i] = 0;
+        others[i] = -1;
+    }
+    // Reserved symbol, so that no code is all ones.
+    freq[256] = 1;
+    codesize[256] = 0;
+    others[256] = -1;
+
+    for ( ;; ) {
+        // The two least frequent trees, ties going to the larger symbol.
+        int c1 = -1;
+        int c2 = -1;
+        uint32_t v1 = 0xffffffff;
+        uint32_t v2 = 0xffffffff;
+        for ( int i = 0; i <= 256; ++i ) {
+            if (freq[i] && freq[i] <= v1) {
+                v1 = freq[i];
+                c1 = i;
+            }
+        }
+        for ( int i = 0; i <= 256; ++i ) {
+            if (freq[i] && freq[i] <= v2 && i != c1) {
+                v2 = freq[i];
+                c2 = i;
+            }
+        }
+        if (c2 < 0) {
+            break;
+        }
+
+        freq[c1] += freq[c2];
+        freq[c2] = 0;
+
+        ++codesize[c1];
+        while (others[c1] >= 0) {
+            c1 = others[c1];
+            ++codesize[c1];
+        }
+        others[c1] = c2;
+        ++codesize[c2];
+        while (others[c2] >= 0) {
+            c2 = others[c2];
+            ++codesize[c2];
+        }
+    }
+
+    for ( int i = 0; i <= 256; ++i ) {
+        if (codesize[i]) {
+            assert(codesize[i] <= 32);
+            ++bitcount[codesize[i]];
+        }
+    }
+
+    // Move codes longer than 16 bits up the tree.
+    for ( int i = 32; i > 16; --i ) {
+        while (bitcount[i] > 0) {
+            int j = i - 2;
+            while (bitcount[j] == 0) {
+                --j;
+            }
+            bitcount[i] -= 2;
+            bitcount[i - 1] += 1;
+            bitcount[j + 1] += 2;
+            bitcount[j] -= 1;
+        }
+    }
+    // Drop the reserved symbol from the longest codes.
+    int longest = 16;
+    while (bitcount[longest] == 0) {
+        --longest;
+    }
+    --bitcount[longest];
+
+    for ( int i = 0; i < 16; ++i ) {
+        bits[i] = (uint8_t)bitcount[i + 1];
+    }
+    int n = 0;
+    for ( int length = 1; length <= 32; ++length ) {
+        for ( int i = 0; i < 256; ++i ) {
+            if (codesize[i] == length) {
+                vals[n++] = (uint8_t)i;
+            }
+        }
+    }
+}
+
+// Set up the extended huffman tables in state from ht_bits and ht_vals.
+static void tjei_huff_expand(TJEState* state)
+{
+    assert(state);
 
     // How many codes in total for each of LUMA_(DC|AC) and CHROMA_(DC|AC)
     int32_t spec_tables_len[4] = { 0 };
@@ -940,22 +1475,386 @@ static void tjei_huff_expand(TJEState* state)
     }
 }
 
-static int tjei_encode_main(TJEState* state,
-                            const unsigned char* src_data,
-                            const int width,
-                            const int height,
-                            const int src_num_components)
+// Color conversion is done in fixed point with coefficients scaled by
+// 2^TJEI_YCC_PRECISION. The integer sums are exact, so converting them to
+// float gives the same samples on every code path.
+#define TJEI_YCC_PRECISION 14
+
+// Sets up state->ycc_coeffs for a pixel with red, green and blue at the given
+// byte offsets.
+static void tjei_setup_ycc(TJEState* state, int r, int g, int b)
 {
-    if (src_num_components != 3 && src_num_components != 4) {
-        return 0;
+    static const float coeffs[3][3] = {
+        {  0.299f,    0.587f,   0.114f  },
+        { -0.1687f,  -0.3313f,  0.5f    },
+        {  0.5f,     -0.4187f, -0.0813f },
+    };
+    const int offsets[3] = { r, g, b };
+    memset(state->ycc_coeffs, 0, sizeof(state->ycc_coeffs));
+    for ( int i = 0; i < 3; ++i ) {
+        for ( int c = 0; c < 3; ++c ) {
+            float scaled = coeffs[i][c] * (float)(1 << TJEI_YCC_PRECISION);
+            state->ycc_coeffs[i][offsets[c]] = (int16_t)(scaled < 0 ? scaled - 0.5f : scaled + 0.5f);
+        }
     }
+}
 
-    if (width > 0xffff || height > 0xffff) {
-        return 0;
+#if TJEI_AVX2
+// Converts `count` 4-byte pixels, a multiple of 8.
+TJEI_TARGET_AVX2
+static void tjei_convert_avx2(const int16_t coeffs[3][4], const uint8_t* src, int count,
+                              float* out_y, float* out_b, float* out_r)
+{
+    const __m256 scale = _mm256_set1_ps(1.0f / (float)(1 << TJEI_YCC_PRECISION));
+    const __m256 luma_offset = _mm256_set1_ps(128.0f);
+    __m256i k[3];
+    for ( int i = 0; i < 3; ++i ) {
+        k[i] = _mm256_set_epi16(coeffs[i][3], coeffs[i][2], coeffs[i][1], coeffs[i][0],
+                                coeffs[i][3], coeffs[i][2], coeffs[i][1], coeffs[i][0],
+                                coeffs[i][3], coeffs[i][2], coeffs[i][1], coeffs[i][0],
+                                coeffs[i][3], coeffs[i][2], coeffs[i][1], coeffs[i][0]);
+    }
+    float* out[3] = { out_y, out_b, out_r };
+
+    for ( int x = 0; x < count; x += 8 ) {
+        __m256i pixels = _mm256_loadu_si256((const __m256i*)(src + 4 * x));
+        __m256i lo = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(pixels));       // Pixels 0-3
+        __m256i hi = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(pixels, 1));  // Pixels 4-7
+        for ( int i = 0; i < 3; ++i ) {
+            // Two partial sums per pixel, added pairwise. hadd works within
+            // 128 bit lanes, which leaves the pixels in 0 1 4 5 2 3 6 7 order.
+            __m256i sums = _mm256_hadd_epi32(_mm256_madd_epi16(lo, k[i]), _mm256_madd_epi16(hi, k[i]));
+            sums = _mm256_permute4x64_epi64(sums, _MM_SHUFFLE(3, 1, 2, 0));
+            __m256 v = _mm256_mul_ps(_mm256_cvtepi32_ps(sums), scale);
+            if (i == 0) {
+                v = _mm256_sub_ps(v, luma_offset);
+            }
+            _mm256_storeu_ps(out[i] + x, v);
+        }
+    }
+}
+#endif
+
+// Converts pixels [x0, x1) of one source row to Y, Cb and Cr. Samples past
+// `width` repeat the last pixel, so MCUs on the right edge need no clamping.
+static void tjei_convert_row(const TJEState* state,
+                             const uint8_t* src,
+                             const int width,
+                             const int x0,
+                             const int x1,
+                             float* out_y,
+                             float* out_b,
+                             float* out_r)
+{
+    const float scale = 1.0f / (float)(1 << TJEI_YCC_PRECISION);
+    const int16_t* ky = state->ycc_coeffs[0];
+    const int16_t* kb = state->ycc_coeffs[1];
+    const int16_t* kr = state->ycc_coeffs[2];
+    const int end = x1 < width ? x1 : width;
+    int x = x0;
+
+#if TJEI_AVX2
+    if (state->use_avx2 && state->bytes_per_pixel == 4) {
+        int count = (end - x0) & ~7;
+        tjei_convert_avx2(state->ycc_coeffs, src + 4 * x0, count, out_y + x0, out_b + x0, out_r + x0);
+        x += count;
+    }
+#endif
+
+    for ( ; x < end; ++x ) {
+        // The fourth byte, if any, is alpha or padding and has no weight.
+        const uint8_t* p = src + x * state->bytes_per_pixel;
+        out_y[x] = (float)(ky[0] * p[0] + ky[1] * p[1] + ky[2] * p[2]) * scale - 128.0f;
+        out_b[x] = (float)(kb[0] * p[0] + kb[1] * p[1] + kb[2] * p[2]) * scale;
+        out_r[x] = (float)(kr[0] * p[0] + kr[1] * p[1] + kr[2] * p[2]) * scale;
+    }
+    for ( ; x < x1; ++x ) {
+        out_y[x] = out_y[width - 1];
+        out_b[x] = out_b[width - 1];
+        out_r[x] = out_r[width - 1];
+    }
+}
+
+// Quantized coefficients of every MCU of the previous frame, with a hash of
+// the source pixels they came from.
+typedef struct TJEIBlockCache
+{
+    uint64_t*   hashes;
+    uint8_t*    valid;
+    int16_t*    coeffs;     // (luma blocks + 2) * 64 per MCU, in zig-zag order.
+} TJEIBlockCache;
+
+#define TJEI_HASH_PRIME_1 0x9E3779B185EBCA87ULL
+#define TJEI_HASH_PRIME_2 0xC2B2AE3D27D4EB4FULL
+
+// 64 bit hash of the source pixels of the MCU at (x, y), clipped to the
+// image. Four independent lanes so that the multiplies overlap.
+static uint64_t tjei_hash_mcu(const TJEState* state,
+                              const unsigned char* src_data,
+                              const int width,
+                              const int height,
+                              const int x,
+                              const int y)
+{
+    const int rows = (y + 8 * state->v_factor < height) ? 8 * state->v_factor : height - y;
+    const int cols = (x + 8 * state->h_factor < width) ? 8 * state->h_factor : width - x;
+    const size_t bytes = (size_t)cols * (size_t)state->bytes_per_pixel;
+    uint64_t lanes[4] = { TJEI_HASH_PRIME_1, TJEI_HASH_PRIME_2, (uint64_t)rows, (uint64_t)cols };
+
+    for ( int r = 0; r < rows; ++r ) {
+        const uint8_t* p = src_data + (size_t)(y + r) * state->stride + (size_t)x * (size_t)state->bytes_per_pixel;
+        size_t i = 0;
+        for ( ; i + 32 <= bytes; i += 32 ) {
+            for ( int l = 0; l < 4; ++l ) {
+                uint64_t v;
+                memcpy(&v, p + i + 8 * l, 8);
+                lanes[l] = (lanes[l] ^ v) * TJEI_HASH_PRIME_1;
+                lanes[l] ^= lanes[l] >> 29;
+            }
+        }
+        for ( ; i < bytes; ++i ) {
+            lanes[i & 3] = (lanes[i & 3] ^ p[i]) * TJEI_HASH_PRIME_2;
+        }
     }
 
+    uint64_t h = lanes[0] ^ (lanes[1] * TJEI_HASH_PRIME_2) ^ (lanes[2] * TJEI_HASH_PRIME_1) ^ lanes[3];
+    h ^= h >> 33;
+    h *= TJEI_HASH_PRIME_2;
+    h ^= h >> 29;
+    return h;
+}
+
+// Bytes needed for the color conversion strip of tjei_encode_mcu_rows.
+static size_t tjei_strip_size(const TJEState* state, const int width)
+{
+    const int mcu_w = 8 * state->h_factor;
+    const int strip_stride = (width + mcu_w - 1) / mcu_w * mcu_w;
+    return 3 * (size_t)strip_stride * (size_t)(8 * state->v_factor) * sizeof(float);
+}
+
+// Encodes MCU rows [mcu_row_begin, mcu_row_end) as one entropy-coded segment:
+// DC predictions start from zero and the last byte is padded with 1 bits, so
+// segments can be separated by restart markers.
+static int tjei_encode_mcu_rows(TJEState* state,
+                                struct TJEProcessedQT* pqt,
+                                const unsigned char* src_data,
+                                const int width,
+                                const int height,
+                                const int mcu_row_begin,
+                                const int mcu_row_end)
+{
+#if TJE_USE_FAST_DCT
+    float* qt_luma = pqt->luma;
+    float* qt_chroma = pqt->chroma;
+#else
+    (void)pqt;
+    uint8_t* qt_luma = state->qt_luma;
+    uint8_t* qt_chroma = state->qt_chroma;
+#endif
+    // One MCU: h_factor * v_factor luma blocks, then one block per chroma
+    // component averaged over h_factor x v_factor pixels.
+    const int mcu_w = 8 * state->h_factor;
+    const int mcu_h = 8 * state->v_factor;
+    const int num_y_blocks = state->h_factor * state->v_factor;
+    const int num_blocks = num_y_blocks + 2;
+    const float chroma_weight = 1.0f / (float)num_y_blocks;
+    TJEIBlockCache* cache = state->cache;
+
+    // One strip of mcu_h rows, converted to planar YCbCr ahead of the MCUs.
+    // With the block cache only the MCUs that changed get converted.
+    const int strip_stride = (width + mcu_w - 1) / mcu_w * mcu_w;
+    const size_t plane_size = (size_t)strip_stride * (size_t)mcu_h;
+    float* strip = state->strip;
+    if (!strip) {
+        strip = (float*)malloc(tjei_strip_size(state, width));
+        if (!strip) {
+            return 0;
+        }
+    }
+    float* planes[3] = { strip, strip + plane_size, strip + 2 * plane_size };
+
+    float du_y[4][64];
+    float du_b[64];
+    float du_r[64];
+
+    int du[6][64];  // Quantized MCU: luma blocks, Cb, Cr.
+
+    // Set diff to 0.
+    int pred_y = 0;
+    int pred_b = 0;
+    int pred_r = 0;
+
+    // Bit stack
+    uint32_t bitbuffer = 0;
+    uint32_t location = 0;
+
+
+    const int y_end = (mcu_row_end * mcu_h < height) ? mcu_row_end * mcu_h : height;
+
+    for ( int y = mcu_row_begin * mcu_h; y < y_end; y += mcu_h ) {
+        if (!cache) {
+            for ( int off_y = 0; off_y < mcu_h; ++off_y ) {
+                int row = (y + off_y < height) ? y + off_y : height - 1;
+                tjei_convert_row(state, src_data + (size_t)row * state->stride,
+                                 width, 0, strip_stride,
+                                 planes[0] + off_y * strip_stride,
+                                 planes[1] + off_y * strip_stride,
+                                 planes[2] + off_y * strip_stride);
+            }
+        }
+
+        for ( int x = 0; x < width; x += mcu_w ) {
+            size_t mcu_index = 0;
+            uint64_t hash = 0;
+            int cached = 0;
+            if (cache) {
+                mcu_index = (size_t)(y / mcu_h) * (size_t)state->mcus_per_row + (size_t)(x / mcu_w);
+                hash = tjei_hash_mcu(state, src_data, width, height, x, y);
+                cached = cache->valid[mcu_index] && cache->hashes[mcu_index] == hash;
+            }
+
+            if (cached) {
+                const int16_t* coeffs = cache->coeffs + mcu_index * (size_t)num_blocks * 64;
+                for ( int i = 0; i < num_blocks; ++i ) {
+                    for ( int k = 0; k < 64; ++k ) {
+                        du[i][k] = coeffs[i * 64 + k];
+                    }
+                }
+            } else {
+                if (cache) {
+                    for ( int off_y = 0; off_y < mcu_h; ++off_y ) {
+                        int row = (y + off_y < height) ? y + off_y : height - 1;
+                        tjei_convert_row(state, src_data + (size_t)row * state->stride,
+                                         width, x, x + mcu_w,
+                                         planes[0] + off_y * strip_stride,
+                                         planes[1] + off_y * strip_stride,
+                                         planes[2] + off_y * strip_stride);
+                    }
+                }
+
+                // Block loop: ====
+                for ( int i = 0; i < num_y_blocks; ++i ) {
+                    const float* block = planes[0] + (i / state->h_factor) * 8 * strip_stride
+                                                   + x + (i % state->h_factor) * 8;
+                    for ( int off_y = 0; off_y < 8; ++off_y ) {
+                        memcpy(du_y[i] + off_y * 8, block + off_y * strip_stride, 8 * sizeof(float));
+                    }
+                }
+                if ( num_y_blocks == 1 ) {
+                    for ( int off_y = 0; off_y < 8; ++off_y ) {
+                        memcpy(du_b + off_y * 8, planes[1] + off_y * strip_stride + x, 8 * sizeof(float));
+                        memcpy(du_r + off_y * 8, planes[2] + off_y * strip_stride + x, 8 * sizeof(float));
+                    }
+                } else {
+                    // 4:2:2 and 4:2:0 both have h_factor == 2.
+                    for ( int off_y = 0; off_y < 8; ++off_y ) {
+                        const float* cb = planes[1] + off_y * state->v_factor * strip_stride + x;
+                        const float* cr = planes[2] + off_y * state->v_factor * strip_stride + x;
+                        for ( int off_x = 0; off_x < 8; ++off_x ) {
+                            float sum_b = 0;
+                            float sum_r = 0;
+                            for ( int v = 0; v < state->v_factor; ++v ) {
+                                sum_b += cb[v * strip_stride + 2 * off_x] + cb[v * strip_stride + 2 * off_x + 1];
+                                sum_r += cr[v * strip_stride + 2 * off_x] + cr[v * strip_stride + 2 * off_x + 1];
+                            }
+                            du_b[off_y * 8 + off_x] = sum_b * chroma_weight;
+                            du_r[off_y * 8 + off_x] = sum_r * chroma_weight;
+                        }
+                    }
+                }
+
+                for ( int i = 0; i < num_y_blocks; ++i ) {
+                    tjei_quantize_MCU(state, du_y[i], qt_luma, du[i]);
+                }
+                tjei_quantize_MCU(state, du_b, qt_chroma, du[num_y_blocks]);
+                tjei_quantize_MCU(state, du_r, qt_chroma, du[num_y_blocks + 1]);
+
+                if (cache) {
+                    int16_t* coeffs = cache->coeffs + mcu_index * (size_t)num_blocks * 64;
+                    for ( int i = 0; i < num_blocks; ++i ) {
+                        for ( int k = 0; k < 64; ++k ) {
+                            coeffs[i * 64 + k] = (int16_t)du[i][k];
+                        }
+                    }
+                    cache->hashes[mcu_index] = hash;
+                    cache->valid[mcu_index] = 1;
+                }
+            }
+
+            // DC prediction runs across MCUs, so cached blocks still have
+            // to be coded again.
+            for ( int i = 0; i < num_y_blocks; ++i ) {
+                tjei_code_MCU(state, du[i], TJEI_LUMA_DC, TJEI_LUMA_AC,
+                              &pred_y, &bitbuffer, &location);
+            }
+            tjei_code_MCU(state, du[num_y_blocks], TJEI_CHROMA_DC, TJEI_CHROMA_AC,
+                          &pred_b, &bitbuffer, &location);
+            tjei_code_MCU(state, du[num_y_blocks + 1], TJEI_CHROMA_DC, TJEI_CHROMA_AC,
+                          &pred_r, &bitbuffer, &location);
+        }
+    }
+
+    // Flush
+    if (location > 0 && location < 8) {
+        uint16_t pad = (uint16_t)(8 - location);
+        tjei_write_bits(state, &bitbuffer, &location, pad, (uint16_t)((1 << pad) - 1));
+    }
+
+    if (strip != state->strip) {
+        free(strip);
+    }
+    return 1;
+}
+
+static void tjei_flush(TJEState* state)
+{
+    if (state->output_buffer_count) {
+        state->write_context.func(state->write_context.context, state->output_buffer, (int)state->output_buffer_count);
+        state->output_buffer_count = 0;
+    }
+}
+
+typedef struct
+{
+    TJEState*               state;
+    struct TJEProcessedQT*  pqt;
+    const unsigned char*    src_data;
+    int                     width;
+    int                     height;
+    TJEIBuffer*        buffers;
+    float**                 strips;   // One per slice, or NULL.
+} TJEISliceJob;
+
+static void tjei_encode_slice(void* arg, int index)
+{
+    TJEISliceJob* job = (TJEISliceJob*)arg;
+
+    // Tables are shared read-only, each slice has its own output buffer.
+    TJEState slice_state = *job->state;
+    slice_state.sink = &job->buffers[index];
+    slice_state.strip = job->strips ? job->strips[index] : NULL;
+    if (slice_state.freq) {
+        memset(job->buffers[index].freq, 0, sizeof(job->buffers[index].freq));
+        slice_state.freq = job->buffers[index].freq;
+    }
+
+    // Rows past the image are clipped by tjei_encode_mcu_rows.
+    int begin = index * slice_state.slice_rows;
+    if (!tjei_encode_mcu_rows(&slice_state, job->pqt, job->src_data,
+                              job->width, job->height, begin, begin + slice_state.slice_rows)) {
+        job->buffers[index].failed = 1;
+    }
+}
+
+static void tjei_write_RST(TJEState* state, int index)
+{
+    uint16_t RST = tjei_be_word((uint16_t)(0xffd0 + (index % 8)));
+    tjei_write(state, &RST, sizeof(uint16_t), 1);
+}
+
+static void tjei_process_qt(const TJEState* state, struct TJEProcessedQT* pqt)
+{
 #if TJE_USE_FAST_DCT
-    struct TJEProcessedQT pqt;
     // Again, taken from classic japanese implementation.
     //
     /* For float AA&N IDCT method, divisors are equal to quantization
@@ -975,12 +1874,36 @@ static int tjei_encode_main(TJEState* state,
     for(int y=0; y<8; y++) {
         for(int x=0; x<8; x++) {
             int i = y*8 + x;
-            pqt.luma[y*8+x] = 1.0f / (8 * aan_scales[x] * aan_scales[y] * state->qt_luma[tjei_zig_zag[i]]);
-            pqt.chroma[y*8+x] = 1.0f / (8 * aan_scales[x] * aan_scales[y] * state->qt_chroma[tjei_zig_zag[i]]);
+            pqt->luma[y*8+x] = 1.0f / (8 * aan_scales[x] * aan_scales[y] * state->qt_luma[tjei_zig_zag[i]]);
+            pqt->chroma[y*8+x] = 1.0f / (8 * aan_scales[x] * aan_scales[y] * state->qt_chroma[tjei_zig_zag[i]]);
         }
     }
+#else
+    (void)state;
+    (void)pqt;
 #endif
+}
 
+// Slices of MCU rows, separated by restart markers when there is more than
+// one.
+static void tjei_plan_slices(TJEState* state, const int width, const int height)
+{
+    state->mcu_rows = (height + 8 * state->v_factor - 1) / (8 * state->v_factor);
+    state->mcus_per_row = (width + 8 * state->h_factor - 1) / (8 * state->h_factor);
+    state->slice_rows = state->mcu_rows;
+    if (state->restart_rows > 0 && state->restart_rows < state->mcu_rows) {
+        state->slice_rows = state->restart_rows;
+        // The restart interval is a 16 bit count of MCUs.
+        if (state->slice_rows * state->mcus_per_row > 0xffff) {
+            state->slice_rows = 0xffff / state->mcus_per_row;
+        }
+    }
+    state->num_slices = (state->mcu_rows + state->slice_rows - 1) / state->slice_rows;
+}
+
+// Everything up to and including the start of scan.
+static void tjei_write_headers(TJEState* state, const int width, const int height)
+{
     { // Write header
         TJEJPEGHeader header;
         // JFIF header.
@@ -1030,7 +1953,8 @@ static int tjei_encode_main(TJEState* state,
         for (int i = 0; i < 3; ++i) {
             TJEComponentSpec spec;
             spec.component_id = (uint8_t)(i + 1);  // No particular reason. Just 1, 2, 3.
-            spec.sampling_factors = (uint8_t)0x11;
+            spec.sampling_factors = (i == 0) ? (uint8_t)((state->h_factor << 4) | state->v_factor)
+                                             : (uint8_t)0x11;
             spec.qt = tables[i];
 
             header.component_spec[i] = spec;
@@ -1044,6 +1968,15 @@ static int tjei_encode_main(TJEState* state,
     tjei_write_DHT(state, state->ht_bits[TJEI_CHROMA_DC], state->ht_vals[TJEI_CHROMA_DC], TJEI_DC, 1);
     tjei_write_DHT(state, state->ht_bits[TJEI_CHROMA_AC], state->ht_vals[TJEI_CHROMA_AC], TJEI_AC, 1);
 
+    if (state->num_slices > 1) {  // Write restart interval
+        uint16_t DRI = tjei_be_word(0xffdd);
+        uint16_t len = tjei_be_word(0x0004);
+        uint16_t interval = tjei_be_word((uint16_t)(state->slice_rows * state->mcus_per_row));
+        tjei_write(state, &DRI, sizeof(uint16_t), 1);
+        tjei_write(state, &len, sizeof(uint16_t), 1);
+        tjei_write(state, &interval, sizeof(uint16_t), 1);
+    }
+
     // Write start of scan
     {
         TJEScanHeader header;
@@ -1070,103 +2003,108 @@ static int tjei_encode_main(TJEState* state,
         tjei_write(state, &header, sizeof(TJEScanHeader), 1);
 
     }
-    // Write compressed data.
-
-    float du_y[64];
-    float du_b[64];
-    float du_r[64];
-
-    // Set diff to 0.
-    int pred_y = 0;
-    int pred_b = 0;
-    int pred_r = 0;
-
-    // Bit stack
-    uint32_t bitbuffer = 0;
-    uint32_t location = 0;
-
+}
 
-    for ( int y = 0; y < height; y += 8 ) {
-        for ( int x = 0; x < width; x += 8 ) {
-            // Block loop: ====
-            for ( int off_y = 0; off_y < 8; ++off_y ) {
-                for ( int off_x = 0; off_x < 8; ++off_x ) {
-                    int block_index = (off_y * 8 + off_x);
+// Entropy-coded data and the end of image. `buffers` and `strips` hold one
+// entry per slice and are owned by the caller, NULL to allocate them here.
+static int tjei_write_scan(TJEState* state,
+                           struct TJEProcessedQT* pqt,
+                           const unsigned char* src_data,
+                           const int width,
+                           const int height,
+                           TJEIBuffer* buffers,
+                           float** strips)
+{
+    const int num_slices = state->num_slices;
+    const int slice_rows = state->slice_rows;
 
-                    int src_index = (((y + off_y) * width) + (x + off_x)) * src_num_components;
+    // Write compressed data.
+    if (num_slices == 1 || !state->parallel) {
+        for ( int i = 0; i < num_slices; ++i ) {
+            if (i > 0) {
+                tjei_write_RST(state, i - 1);
+            }
+            // Rows past the image are clipped by tjei_encode_mcu_rows.
+            if (!tjei_encode_mcu_rows(state, pqt, src_data, width, height,
+                                      i * slice_rows, (i + 1) * slice_rows)) {
+                return 0;
+            }
+        }
+    } else {
+        TJEISliceJob job;
+        job.state = state;
+        job.pqt = pqt;
+        job.src_data = src_data;
+        job.width = width;
+        job.height = height;
+        job.strips = strips;
+        job.buffers = buffers;
+        if (buffers) {
+            for ( int i = 0; i < num_slices; ++i ) {
+                buffers[i].size = 0;
+                buffers[i].failed = 0;
+            }
+        } else {
+            job.buffers = (TJEIBuffer*)calloc((size_t)num_slices, sizeof(TJEIBuffer));
+            if (!job.buffers) {
+                return 0;
+            }
+        }
 
-                    int col = x + off_x;
-                    int row = y + off_y;
+        state->parallel(state->parallel_context, tjei_encode_slice, &job, num_slices);
 
-                    if(row >= height) {
-                        src_index -= (width * (row - height + 1)) * src_num_components;
+        int failed = 0;
+        for ( int i = 0; i < num_slices; ++i ) {
+            failed |= job.buffers[i].failed;
+            if (state->freq) {
+                for ( int t = 0; t < 4; ++t ) {
+                    for ( int k = 0; k < 256; ++k ) {
+                        state->freq[t][k] += job.buffers[i].freq[t][k];
                     }
-                    if(col >= width) {
-                        src_index -= (col - width + 1) * src_num_components;
-                    }
-                    assert(src_index < width * height * src_num_components);
-
-                    uint8_t r = src_data[src_index + 0];
-                    uint8_t g = src_data[src_index + 1];
-                    uint8_t b = src_data[src_index + 2];
-
-                    float luma = 0.299f   * r + 0.587f    * g + 0.114f    * b - 128;
-                    float cb   = -0.1687f * r - 0.3313f   * g + 0.5f      * b;
-                    float cr   = 0.5f     * r - 0.4187f   * g - 0.0813f   * b;
-
-                    du_y[block_index] = luma;
-                    du_b[block_index] = cb;
-                    du_r[block_index] = cr;
                 }
             }
-
-            tjei_encode_and_write_MCU(state, du_y,
-#if TJE_USE_FAST_DCT
-                                     pqt.luma,
-#else
-                                     state->qt_luma,
-#endif
-                                     state->ehuffsize[TJEI_LUMA_DC], state->ehuffcode[TJEI_LUMA_DC],
-                                     state->ehuffsize[TJEI_LUMA_AC], state->ehuffcode[TJEI_LUMA_AC],
-                                     &pred_y, &bitbuffer, &location);
-            tjei_encode_and_write_MCU(state, du_b,
-#if TJE_USE_FAST_DCT
-                                     pqt.chroma,
-#else
-                                     state->qt_chroma,
-#endif
-                                     state->ehuffsize[TJEI_CHROMA_DC], state->ehuffcode[TJEI_CHROMA_DC],
-                                     state->ehuffsize[TJEI_CHROMA_AC], state->ehuffcode[TJEI_CHROMA_AC],
-                                     &pred_b, &bitbuffer, &location);
-            tjei_encode_and_write_MCU(state, du_r,
-#if TJE_USE_FAST_DCT
-                                     pqt.chroma,
-#else
-                                     state->qt_chroma,
-#endif
-                                     state->ehuffsize[TJEI_CHROMA_DC], state->ehuffcode[TJEI_CHROMA_DC],
-                                     state->ehuffsize[TJEI_CHROMA_AC], state->ehuffcode[TJEI_CHROMA_AC],
-                                     &pred_r, &bitbuffer, &location);
-
-
         }
-    }
-
-    // Finish the image.
-    { // Flush
-        if (location > 0 && location < 8) {
-            tjei_write_bits(state, &bitbuffer, &location, (uint16_t)(8 - location), 0);
+        for ( int i = 0; i < num_slices && !failed; ++i ) {
+            if (i > 0) {
+                tjei_write_RST(state, i - 1);
+            }
+            tjei_write(state, job.buffers[i].data, job.buffers[i].size, 1);
+        }
+        if (!buffers) {
+            for ( int i = 0; i < num_slices; ++i ) {
+                free(job.buffers[i].data);
+            }
+            free(job.buffers);
+        }
+        if (failed) {
+            return 0;
         }
     }
+
     uint16_t EOI = tjei_be_word(0xffd9);
     tjei_write(state, &EOI, sizeof(uint16_t), 1);
 
-    if (state->output_buffer_count) {
-        state->write_context.func(state->write_context.context, state->output_buffer, (int)state->output_buffer_count);
-        state->output_buffer_count = 0;
+    return 1;
+}
+
+static int tjei_encode_main(TJEState* state,
+                            const unsigned char* src_data,
+                            const int width,
+                            const int height)
+{
+    if (width > 0xffff || height > 0xffff) {
+        return 0;
     }
 
-    return 1;
+    struct TJEProcessedQT pqt;
+    tjei_process_qt(state, &pqt);
+    tjei_plan_slices(state, width, height);
+    tjei_write_headers(state, width, height);
+
+    int result = tjei_write_scan(state, &pqt, src_data, width, height, NULL, NULL);
+    tjei_flush(state);
+
+    return result;
 }
 
 int tje_encode_to_file(const char* dest_path,
@@ -1200,7 +2138,7 @@ int tje_encode_to_file_at_quality(const char* dest_path,
     }
 
     int result = tje_encode_with_func(tjei_stdlib_func, fd,
-                                      quality, width, height, num_components, src_data);
+                                      quality, TJE_SAMPLING_444, width, height, num_components, 0, src_data);
 
     result |= 0 == fclose(fd);
 
@@ -1210,24 +2148,58 @@ int tje_encode_to_file_at_quality(const char* dest_path,
 int tje_encode_with_func(tje_write_func* func,
                          void* context,
                          const int quality,
+                         const int sampling,
                          const int width,
                          const int height,
-                         const int num_components,
+                         const int format,
+                         const int stride,
                          const unsigned char* src_data)
+{
+    return tje_encode_sliced_with_func(func, context, NULL, NULL, 0,
+                                       quality, sampling, width, height, format, stride, src_data);
+}
+
+// Validates the parameters and sets up all tables. Everything but the write
+// context, which is per frame.
+static int tjei_init(TJEState* state,
+                     tje_parallel_func* parallel,
+                     void* parallel_context,
+                     const int slice_rows,
+                     const int quality,
+                     const int sampling,
+                     const int width,
+                     const int format,
+                     const int stride)
 {
     if (quality < 1 || quality > 3) {
         tje_log("[ERROR] -- Valid 'quality' values are 1 (lowest), 2, or 3 (highest)\n");
         return 0;
     }
 
-    TJEState state = { 0 };
+    switch (sampling) {
+    case TJE_SAMPLING_444:
+        state->h_factor = 1;
+        state->v_factor = 1;
+        break;
+    case TJE_SAMPLING_422:
+        state->h_factor = 2;
+        state->v_factor = 1;
+        break;
+    case TJE_SAMPLING_420:
+        state->h_factor = 2;
+        state->v_factor = 2;
+        break;
+    default:
+        tje_log("[ERROR] -- Invalid 'sampling' value\n");
+        return 0;
+    }
 
     uint8_t qt_factor = 1;
     switch(quality) {
     case 3:
         for ( int i = 0; i < 64; ++i ) {
-            state.qt_luma[i]   = 1;
-            state.qt_chroma[i] = 1;
+            state->qt_luma[i]   = 1;
+            state->qt_chroma[i] = 1;
         }
         break;
     case 2:
@@ -1235,13 +2207,13 @@ int tje_encode_with_func(tje_write_func* func,
         // don't break. fall through.
     case 1:
         for ( int i = 0; i < 64; ++i ) {
-            state.qt_luma[i]   = tjei_default_qt_luma_from_spec[i] / qt_factor;
-            if (state.qt_luma[i] == 0) {
-                state.qt_luma[i] = 1;
+            state->qt_luma[i]   = tjei_default_qt_luma_from_spec[i] / qt_factor;
+            if (state->qt_luma[i] == 0) {
+                state->qt_luma[i] = 1;
             }
-            state.qt_chroma[i] = tjei_default_qt_chroma_from_paper[i] / qt_factor;
-            if (state.qt_chroma[i] == 0) {
-                state.qt_chroma[i] = 1;
+            state->qt_chroma[i] = tjei_default_qt_chroma_from_paper[i] / qt_factor;
+            if (state->qt_chroma[i] == 0) {
+                state->qt_chroma[i] = 1;
             }
         }
         break;
@@ -1250,6 +2222,60 @@ int tje_encode_with_func(tje_write_func* func,
         break;
     }
 
+#if TJEI_AVX2
+    state->use_avx2 = tjei_cpu_has_avx2();
+#endif
+    switch (format) {
+    case TJE_FORMAT_RGB:
+        state->bytes_per_pixel = 3;
+        tjei_setup_ycc(state, 0, 1, 2);
+        break;
+    case TJE_FORMAT_RGBA:
+    case TJE_FORMAT_RGBX:
+        state->bytes_per_pixel = 4;
+        tjei_setup_ycc(state, 0, 1, 2);
+        break;
+    case TJE_FORMAT_BGRA:
+    case TJE_FORMAT_BGRX:
+        state->bytes_per_pixel = 4;
+        tjei_setup_ycc(state, 2, 1, 0);
+        break;
+    default:
+        tje_log("[ERROR] -- Invalid 'format' value\n");
+        return 0;
+    }
+    state->stride = stride > 0 ? (size_t)stride : (size_t)width * (size_t)state->bytes_per_pixel;
+
+    state->restart_rows = slice_rows;
+    state->parallel = parallel;
+    state->parallel_context = parallel_context;
+
+
+    tjei_huff_default(state);
+    tjei_huff_expand(state);
+
+    return 1;
+}
+
+int tje_encode_sliced_with_func(tje_write_func* func,
+                                void* context,
+                                tje_parallel_func* parallel,
+                                void* parallel_context,
+                                const int slice_rows,
+                                const int quality,
+                                const int sampling,
+                                const int width,
+                                const int height,
+                                const int format,
+                                const int stride,
+                                const unsigned char* src_data)
+{
+    TJEState state = { 0 };
+
+    if (!tjei_init(&state, parallel, parallel_context, slice_rows, quality, sampling, width, format, stride)) {
+        return 0;
+    }
+
     TJEWriteContext wc = { 0 };
 
     wc.context = context;
@@ -1257,13 +2283,272 @@ int tje_encode_with_func(tje_write_func* func,
 
     state.write_context = wc;
 
+    int result = tjei_encode_main(&state, src_data, width, height);
+
+    return result;
+}
+
+struct TJEEncoder
+{
+    TJEState                state;
+    struct TJEProcessedQT   pqt;
+    int                     width;
+    int                     height;
+
+    // Everything up to the start of scan, identical for every frame.
+    TJEIBuffer         header;
+
+    // Per slice output buffers when encoding in parallel, and color
+    // conversion strips (a single one when encoding serially).
+    TJEIBuffer*        buffers;
+    float**                 strips;
+    int                     num_strips;
+
+    // Optimized Huffman tables, rebuilt every `huffman_frames` frames.
+    int                     huffman_frames;
+    int                     huffman_left;
+    uint8_t                 huffman_bits[4][16];
+    uint8_t                 huffman_vals[4][256];
+
+    TJEIBlockCache          cache;
+};
+
+static void tjei_encoder_write_header(tje_encoder* encoder)
+{
+    TJEState* state = &encoder->state;
+    encoder->header.size = 0;
+    encoder->header.failed = 0;
+    state->sink = &encoder->header;
+    tjei_write_headers(state, encoder->width, encoder->height);
+    state->sink = NULL;
+}
+
+tje_encoder* tje_encoder_create(const int quality,
+                                const int sampling,
+                                const int width,
+                                const int height,
+                                const int format,
+                                const int stride,
+                                const int slice_rows,
+                                tje_parallel_func* parallel,
+                                void* parallel_context)
+{
+    if (width <= 0 || height <= 0 || width > 0xffff || height > 0xffff) {
+        return NULL;
+    }
+
+    tje_encoder* encoder = (tje_encoder*)calloc(1, sizeof(tje_encoder));
+    if (!encoder) {
+        return NULL;
+    }
+    TJEState* state = &encoder->state;
+    if (!tjei_init(state, parallel, parallel_context, slice_rows, quality, sampling, width, format, stride)) {
+        free(encoder);
+        return NULL;
+    }
+    encoder->width = width;
+    encoder->height = height;
+
+    tjei_process_qt(state, &encoder->pqt);
+    tjei_plan_slices(state, width, height);
+    tjei_encoder_write_header(encoder);
+
+    int parallel_slices = state->parallel && state->num_slices > 1;
+    encoder->num_strips = parallel_slices ? state->num_slices : 1;
+    encoder->strips = (float**)calloc((size_t)encoder->num_strips, sizeof(float*));
+    if (parallel_slices) {
+        encoder->buffers = (TJEIBuffer*)calloc((size_t)state->num_slices, sizeof(TJEIBuffer));
+    }
+    int ok = !encoder->header.failed && encoder->strips && (encoder->buffers || !parallel_slices);
+    for ( int i = 0; ok && i < encoder->num_strips; ++i ) {
+        encoder->strips[i] = (float*)malloc(tjei_strip_size(state, width));
+        ok = encoder->strips[i] != NULL;
+    }
+    if (!ok) {
+        tje_encoder_release(encoder);
+        return NULL;
+    }
+    state->strip = encoder->strips[0];
+
+    return encoder;
+}
+
+static void tjei_null_write(void* context, void* data, int size)
+{
+    (void)context;
+    (void)data;
+    (void)size;
+}
 
-    tjei_huff_expand(&state);
+// First pass for optimized tables: counts the symbols of `src_data` and
+// builds the tables and the header from them.
+static int tjei_encoder_learn_huffman(tje_encoder* encoder, const unsigned char* src_data)
+{
+    TJEState* state = &encoder->state;
+    uint32_t freq[4][256];
+    memset(freq, 0, sizeof(freq));
+
+    state->write_context.func = tjei_null_write;
+    state->write_context.context = NULL;
+    state->output_buffer_count = 0;
+    state->freq = freq;
+    int result = tjei_write_scan(state, &encoder->pqt, src_data, encoder->width, encoder->height,
+                                 encoder->buffers, encoder->buffers ? encoder->strips : NULL);
+    state->freq = NULL;
+    if (!result) {
+        return 0;
+    }
+
+    for ( int i = 0; i < 4; ++i ) {
+        int is_ac = (i == TJEI_LUMA_AC || i == TJEI_CHROMA_AC);
+        tjei_huff_optimize(freq[i], is_ac, encoder->huffman_bits[i], encoder->huffman_vals[i]);
+        state->ht_bits[i] = encoder->huffman_bits[i];
+        state->ht_vals[i] = encoder->huffman_vals[i];
+    }
+    tjei_huff_expand(state);
+    tjei_encoder_write_header(encoder);
+    return !encoder->header.failed;
+}
+
+static void tjei_encoder_free_cache(tje_encoder* encoder)
+{
+    free(encoder->cache.hashes);
+    free(encoder->cache.valid);
+    free(encoder->cache.coeffs);
+    memset(&encoder->cache, 0, sizeof(encoder->cache));
+    encoder->state.cache = NULL;
+}
 
-    int result = tjei_encode_main(&state, src_data, width, height, num_components);
+int tje_encoder_cache_blocks(tje_encoder* encoder, const int enable)
+{
+    tjei_encoder_free_cache(encoder);
+    if (!enable) {
+        return 1;
+    }
+
+    TJEState* state = &encoder->state;
+    size_t num_mcus = (size_t)state->mcu_rows * (size_t)state->mcus_per_row;
+    size_t num_blocks = (size_t)(state->h_factor * state->v_factor + 2);
+    encoder->cache.hashes = (uint64_t*)malloc(num_mcus * sizeof(uint64_t));
+    encoder->cache.valid = (uint8_t*)calloc(num_mcus, sizeof(uint8_t));
+    encoder->cache.coeffs = (int16_t*)malloc(num_mcus * num_blocks * 64 * sizeof(int16_t));
+    if (!encoder->cache.hashes || !encoder->cache.valid || !encoder->cache.coeffs) {
+        tjei_encoder_free_cache(encoder);
+        return 0;
+    }
+    state->cache = &encoder->cache;
+    return 1;
+}
+
+void tje_encoder_optimize_huffman(tje_encoder* encoder, const int frames)
+{
+    encoder->huffman_frames = frames > 0 ? frames : 0;
+    encoder->huffman_left = 0;
+    if (!encoder->huffman_frames) {
+        tjei_huff_default(&encoder->state);
+        tjei_huff_expand(&encoder->state);
+        tjei_encoder_write_header(encoder);
+    }
+}
+
+int tje_encoder_encode(tje_encoder* encoder,
+                       tje_write_func* func,
+                       void* context,
+                       const unsigned char* src_data)
+{
+    TJEState* state = &encoder->state;
+
+    if (encoder->huffman_frames) {
+        if (encoder->huffman_left == 0) {
+            if (!tjei_encoder_learn_huffman(encoder, src_data)) {
+                return 0;
+            }
+            encoder->huffman_left = encoder->huffman_frames;
+        }
+        --encoder->huffman_left;
+    }
+
+    state->write_context.func = func;
+    state->write_context.context = context;
+    state->output_buffer_count = 0;
+
+    tjei_write(state, encoder->header.data, encoder->header.size, 1);
+    int result = tjei_write_scan(state, &encoder->pqt, src_data, encoder->width, encoder->height,
+                                 encoder->buffers, encoder->buffers ? encoder->strips : NULL);
+    tjei_flush(state);
 
     return result;
 }
+
+size_t tje_encoder_encode_to_memory(tje_encoder* encoder,
+                                    unsigned char** buffer,
+                                    size_t* capacity,
+                                    const size_t offset,
+                                    const unsigned char* src_data)
+{
+    TJEState* state = &encoder->state;
+
+    if (encoder->huffman_frames) {
+        if (encoder->huffman_left == 0) {
+            if (!tjei_encoder_learn_huffman(encoder, src_data)) {
+                return 0;
+            }
+            encoder->huffman_left = encoder->huffman_frames;
+        }
+        --encoder->huffman_left;
+    }
+
+    TJEIBuffer sink;
+    sink.data = *buffer;
+    sink.capacity = *buffer ? *capacity : 0;
+    sink.size = 0;
+    sink.failed = 0;
+    if (sink.capacity < offset) {
+        // Make room for the reserved bytes, keeping what is already there.
+        uint8_t* grown = (uint8_t*)realloc(sink.data, offset);
+        if (!grown) {
+            return 0;
+        }
+        sink.data = grown;
+        sink.capacity = offset;
+    }
+    sink.size = offset;
+
+    state->sink = &sink;
+    tjei_write(state, encoder->header.data, encoder->header.size, 1);
+    int result = tjei_write_scan(state, &encoder->pqt, src_data, encoder->width, encoder->height,
+                                 encoder->buffers, encoder->buffers ? encoder->strips : NULL);
+    state->sink = NULL;
+
+    *buffer = sink.data;
+    *capacity = sink.capacity;
+    if (!result || sink.failed) {
+        return 0;
+    }
+    return sink.size - offset;
+}
+
+void tje_encoder_release(tje_encoder* encoder)
+{
+    if (!encoder) {
+        return;
+    }
+    if (encoder->buffers) {
+        for ( int i = 0; i < encoder->state.num_slices; ++i ) {
+            free(encoder->buffers[i].data);
+        }
+        free(encoder->buffers);
+    }
+    if (encoder->strips) {
+        for ( int i = 0; i < encoder->num_strips; ++i ) {
+            free(encoder->strips[i]);
+        }
+        free(encoder->strips);
+    }
+    tjei_encoder_free_cache(encoder);
+    free(encoder->header.data);
+    free(encoder);
+}
 // ============================================================
 #endif // TJE_IMPLEMENTATION
 // ============================================================
@@ -1,12 +1,38 @@
 #ifndef __LOCK_H__
 #define __LOCK_H__
 
+#include <stdlib.h>
+
 #if defined(_WIN32) || defined(__MINGW32__) || defined(__MINGW64__)
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600  // Condition variables need Vista.
+#endif
 #include <windows.h>
-typedef HANDLE mutex;
+typedef CRITICAL_SECTION mutex;
+typedef CONDITION_VARIABLE cond;
+typedef SRWLOCK rwlock;
+#define LOCK_PAUSE() YieldProcessor()
 #else
 #include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
 typedef pthread_mutex_t mutex;
+typedef pthread_cond_t cond;
+typedef pthread_rwlock_t rwlock;
+#if defined(__x86_64__) || defined(__i386__)
+#define LOCK_PAUSE() __asm__ __volatile__("pause")
+#elif defined(__aarch64__)
+#define LOCK_PAUSE() __asm__ __volatile__("yield")
+#else
+#define LOCK_PAUSE() do {} while(0)
+#endif
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#define LOCK_FUTEX 1
+#endif
 #endif
 
 mutex * mutex_create();
@@ -17,33 +43,172 @@ void mutex_unlock(mutex * m);
 
 void mutex_release(mutex * m);
 
+cond * cond_create();
+
+// `m` must be locked by the caller. It is released while waiting and locked
+// again before returning. Spurious wake ups are possible, always wait in a
+// loop on the actual condition.
+void cond_wait(cond * c, mutex * m);
+
+// Like cond_wait, but gives up after `ms` milliseconds. Returns 0 on time
+// out.
+int cond_wait_timeout(cond * c, mutex * m, int ms);
+
+void cond_signal(cond * c);
+
+void cond_broadcast(cond * c);
+
+void cond_release(cond * c);
+
+// Any number of readers or a single writer, for data that is read often and
+// changed rarely (configuration, the screen list).
+rwlock * rwlock_create();
+
+void rwlock_read_lock(rwlock * l);
+
+void rwlock_read_unlock(rwlock * l);
+
+void rwlock_write_lock(rwlock * l);
+
+void rwlock_write_unlock(rwlock * l);
+
+void rwlock_release(rwlock * l);
+
+// Event to wait on until another thread sets it, such as "next frame is
+// ready". An auto reset event lets one waiter through per event_set and
+// resets itself, a manual reset one stays set until event_reset.
+typedef struct _event {
+    mutex * lock;
+    cond * changed;
+    int manual;
+    int set;
+} event;
+
+event * event_create(int manual_reset);
+
+void event_set(event * e);
+
+void event_reset(event * e);
+
+void event_wait(event * e);
+
+// Returns 0 if the event was not set within `ms` milliseconds.
+int event_wait_timeout(event * e, int ms);
+
+void event_release(event * e);
+
+// Mutex for short critical sections: spins a little while the owner is
+// likely to release it soon, then parks the thread (futex on Linux). The
+// spin budget adapts to how long it usually takes to get the lock.
+typedef struct _adaptive_mutex {
+    int state;          // 0 free, 1 locked, 2 locked with parked waiters.
+    int spins;          // Running estimate of the spins that pay off.
+#ifndef LOCK_FUTEX
+    mutex * park;
+    cond * parked;
 #endif
+} adaptive_mutex;
+
+#define LOCK_MAX_SPINS 1000
+
+adaptive_mutex * adaptive_mutex_create();
+
+void adaptive_mutex_lock(adaptive_mutex * m);
+
+void adaptive_mutex_unlock(adaptive_mutex * m);
+
+void adaptive_mutex_release(adaptive_mutex * m);
+
 
 #if defined(_WIN32) || defined(__MINGW32__) || defined(__MINGW64__)
 
 mutex * mutex_create()
 {
     mutex * m = malloc(sizeof(mutex));
-    *m = CreateMutex(NULL, FALSE, NULL);
+    InitializeCriticalSection(m);
     return m;
 }
 
 void mutex_lock(mutex * m)
 {
-    WaitForSingleObject(*m, INFINITE);
+    EnterCriticalSection(m);
 }
 
 void mutex_unlock(mutex * m)
 {
-    ReleaseMutex(*m);
+    LeaveCriticalSection(m);
 }
 
 void mutex_release(mutex * m)
 {
-    CloseHandle(*m);
+    DeleteCriticalSection(m);
     free(m);
 }
 
+cond * cond_create()
+{
+    cond * c = malloc(sizeof(cond));
+    InitializeConditionVariable(c);
+    return c;
+}
+
+void cond_wait(cond * c, mutex * m)
+{
+    SleepConditionVariableCS(c, m, INFINITE);
+}
+
+int cond_wait_timeout(cond * c, mutex * m, int ms)
+{
+    return SleepConditionVariableCS(c, m, ms) ? 1 : 0;
+}
+
+void cond_signal(cond * c)
+{
+    WakeConditionVariable(c);
+}
+
+void cond_broadcast(cond * c)
+{
+    WakeAllConditionVariable(c);
+}
+
+void cond_release(cond * c)
+{
+    free(c);
+}
+
+rwlock * rwlock_create()
+{
+    rwlock * l = malloc(sizeof(rwlock));
+    InitializeSRWLock(l);
+    return l;
+}
+
+void rwlock_read_lock(rwlock * l)
+{
+    AcquireSRWLockShared(l);
+}
+
+void rwlock_read_unlock(rwlock * l)
+{
+    ReleaseSRWLockShared(l);
+}
+
+void rwlock_write_lock(rwlock * l)
+{
+    AcquireSRWLockExclusive(l);
+}
+
+void rwlock_write_unlock(rwlock * l)
+{
+    ReleaseSRWLockExclusive(l);
+}
+
+void rwlock_release(rwlock * l)
+{
+    free(l);
+}
+
 
 #else
 
@@ -68,10 +233,248 @@ void mutex_unlock(mutex * m)
 
 void mutex_release(mutex * m)
 {
+    pthread_mutex_destroy(m);
     free(m);
 }
 
+cond * cond_create()
+{
+    cond * c = malloc(sizeof(cond));
+#if defined(__APPLE__)
+    pthread_cond_init(c, NULL);
+#else
+    // Timed waits run on the monotonic clock, so that a wall clock jump
+    // doesn't stretch or cut them.
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(c, &attr);
+    pthread_condattr_destroy(&attr);
+#endif
+    return c;
+}
+
+void cond_wait(cond * c, mutex * m)
+{
+    pthread_cond_wait(c, m);
+}
+
+int cond_wait_timeout(cond * c, mutex * m, int ms)
+{
+#if defined(__APPLE__)
+    // No pthread_condattr_setclock, but a relative wait ignores the wall
+    // clock as well.
+    struct timespec delay;
+    delay.tv_sec = ms / 1000;
+    delay.tv_nsec = (long)(ms % 1000) * 1000000;
+    return pthread_cond_timedwait_relative_np(c, m, &delay) != ETIMEDOUT;
+#else
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += (long)(ms % 1000) * 1000000;
+    if(deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    return pthread_cond_timedwait(c, m, &deadline) != ETIMEDOUT;
+#endif
+}
+
+void cond_signal(cond * c)
+{
+    pthread_cond_signal(c);
+}
+
+void cond_broadcast(cond * c)
+{
+    pthread_cond_broadcast(c);
+}
+
+void cond_release(cond * c)
+{
+    pthread_cond_destroy(c);
+    free(c);
+}
+
+rwlock * rwlock_create()
+{
+    rwlock * l = malloc(sizeof(rwlock));
+    pthread_rwlock_init(l, NULL);
+    return l;
+}
+
+void rwlock_read_lock(rwlock * l)
+{
+    pthread_rwlock_rdlock(l);
+}
+
+void rwlock_read_unlock(rwlock * l)
+{
+    pthread_rwlock_unlock(l);
+}
+
+void rwlock_write_lock(rwlock * l)
+{
+    pthread_rwlock_wrlock(l);
+}
+
+void rwlock_write_unlock(rwlock * l)
+{
+    pthread_rwlock_unlock(l);
+}
+
+void rwlock_release(rwlock * l)
+{
+    pthread_rwlock_destroy(l);
+    free(l);
+}
+
 
 #endif
 
+event * event_create(int manual_reset)
+{
+    event * e = malloc(sizeof(event));
+    e->lock = mutex_create();
+    e->changed = cond_create();
+    e->manual = manual_reset;
+    e->set = 0;
+    return e;
+}
 
+void event_set(event * e)
+{
+    mutex_lock(e->lock);
+    e->set = 1;
+    if(e->manual) {
+        cond_broadcast(e->changed);
+    } else {
+        cond_signal(e->changed);
+    }
+    mutex_unlock(e->lock);
+}
+
+void event_reset(event * e)
+{
+    mutex_lock(e->lock);
+    e->set = 0;
+    mutex_unlock(e->lock);
+}
+
+void event_wait(event * e)
+{
+    mutex_lock(e->lock);
+    while(!e->set) {
+        cond_wait(e->changed, e->lock);
+    }
+    if(!e->manual) {
+        e->set = 0;
+    }
+    mutex_unlock(e->lock);
+}
+
+int event_wait_timeout(event * e, int ms)
+{
+    mutex_lock(e->lock);
+    // Spurious wake ups restart the full timeout, which only makes the wait
+    // longer than asked in rare cases.
+    while(!e->set && cond_wait_timeout(e->changed, e->lock, ms)) {
+    }
+    int set = e->set;
+    if(set && !e->manual) {
+        e->set = 0;
+    }
+    mutex_unlock(e->lock);
+    return set;
+}
+
+void event_release(event * e)
+{
+    cond_release(e->changed);
+    mutex_release(e->lock);
+    free(e);
+}
+
+// Parking follows Drepper's "Futexes Are Tricky" mutex: a thread that
+// parks marks the lock 2 so that the owner knows to wake someone up.
+void _adaptive_mutex_park(adaptive_mutex * m)
+{
+#ifdef LOCK_FUTEX
+    while(__atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE) != 0) {
+        syscall(SYS_futex, &m->state, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+    }
+#else
+    mutex_lock(m->park);
+    while(__atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE) != 0) {
+        cond_wait(m->parked, m->park);
+    }
+    mutex_unlock(m->park);
+#endif
+}
+
+void _adaptive_mutex_wake(adaptive_mutex * m)
+{
+#ifdef LOCK_FUTEX
+    syscall(SYS_futex, &m->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+    mutex_lock(m->park);
+    cond_signal(m->parked);
+    mutex_unlock(m->park);
+#endif
+}
+
+adaptive_mutex * adaptive_mutex_create()
+{
+    adaptive_mutex * m = calloc(1, sizeof(adaptive_mutex));
+    m->spins = LOCK_MAX_SPINS / 10;
+#ifndef LOCK_FUTEX
+    m->park = mutex_create();
+    m->parked = cond_create();
+#endif
+    return m;
+}
+
+void adaptive_mutex_lock(adaptive_mutex * m)
+{
+    int expected = 0;
+    if(__atomic_compare_exchange_n(&m->state, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;
+    }
+    // Spin up to twice the usual wait, like glibc's adaptive mutexes, and
+    // move the estimate an eighth of the way towards what this wait took.
+    // The estimate is only a hint: waiters update it without the lock, a
+    // lost update costs nothing.
+    int spins = __atomic_load_n(&m->spins, __ATOMIC_RELAXED);
+    int budget = 2 * spins + 10;
+    if(budget > LOCK_MAX_SPINS) budget = LOCK_MAX_SPINS;
+    for(int i = 0; i < budget; i++) {
+        LOCK_PAUSE();
+        expected = 0;
+        if(__atomic_load_n(&m->state, __ATOMIC_RELAXED) == 0 &&
+                __atomic_compare_exchange_n(&m->state, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&m->spins, spins + (i - spins) / 8, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+    __atomic_store_n(&m->spins, spins + (budget - spins) / 8, __ATOMIC_RELAXED);
+    _adaptive_mutex_park(m);
+}
+
+void adaptive_mutex_unlock(adaptive_mutex * m)
+{
+    if(__atomic_exchange_n(&m->state, 0, __ATOMIC_RELEASE) == 2) {
+        _adaptive_mutex_wake(m);
+    }
+}
+
+void adaptive_mutex_release(adaptive_mutex * m)
+{
+#ifndef LOCK_FUTEX
+    cond_release(m->parked);
+    mutex_release(m->park);
+#endif
+    free(m);
+}
+
+#endif
@@ -1,71 +1,197 @@
 #include "json.h"
 #include "network.h"
 #include "screen.h"
+#include "source.h"
+#include "server.h"
+#include "pipeline.h"
 #include "threads.h"
 #include "lock.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 
-mutex *m1;
-mutex *m2;
-
-void th1()
+void publish(void * context, packet_buffer * packet)
 {
-    mutex_lock(m1);
-    printf("%i\n",1);
-    mutex_unlock(m1);
+    server_publish(context, packet, "image/jpeg");
 }
 
-void th2()
+void poll_clients(void * context, int timeout_ms)
 {
-    mutex_lock(m2);
-    printf("%i\n",2);
-    mutex_unlock(m2);
+    server_poll(context, timeout_ms);
 }
 
-
-
-int main(int argc, char ** argv)
+void usage(const char * name)
 {
+    printf("usage: %s [-p port] [-s screen] [-w width] [-h height] [-f fps] [-q quality] [-n in_flight]\n"
+           "          [-o prefix] [--synthetic desktop|text|video] [--replay file width height]\n"
+           "  -o writes one JPEG per screen to <prefix>-<screen>.jpg and exits.\n", name);
+}
 
-    m1 = mutex_create();
-    m2 = mutex_create();
+// MCU rows per slice of a snapshot encode, 64 pixel rows in 4:2:0.
+#define SNAPSHOT_SLICE_ROWS 4
 
-    thread * t1 = thread_create(th1);
-    thread * t2 = thread_create(th2);
+typedef struct _snapshot {
+    bitmap * frame;
+    int quality;
+    scheduler * slices;
+    char path[256];
+    FILE * file;
+    size_t size;
+} snapshot;
 
-    thread_join(t1);
-    thread_join(t2);
+void snapshot_write(void * context, void * data, int size)
+{
+    snapshot * shot = context;
+    shot->size += fwrite(data, 1, size, shot->file);
+}
 
-    printf("end.\n");
+// Pool task: encodes one screen to its file, returns NULL on failure. The
+// slices of every screen go to one scheduler, so idle threads steal from
+// the busy screens.
+void * snapshot_encode(void * arg)
+{
+    snapshot * shot = arg;
+    bitmap * b = shot->frame;
+    tje_encoder * encoder = tje_encoder_create(shot->quality, TJE_SAMPLING_420, b->width, b->height,
+                                               TJE_FORMAT_BGRX, b->stride, SNAPSHOT_SLICE_ROWS,
+                                               scheduler_parallel, shot->slices);
+    shot->file = fopen(shot->path, "wb");
+    int ok = encoder && shot->file &&
+             tje_encoder_encode(encoder, snapshot_write, shot, (const unsigned char *) b->data);
+    if(shot->file) fclose(shot->file);
+    if(encoder) tje_encoder_release(encoder);
+    return ok ? (void *) shot : NULL;
+}
 
-    thread_release(t1);
-    thread_release(t2);
-    mutex_release(m1);
-    mutex_release(m2);
+// Grabs every screen, then encodes them concurrently, one pool task each.
+// Grabs stay on this thread, the capture connection is not shared.
+int snapshot_screens(source * src, const char * prefix, int quality)
+{
+    int count = src->screens->count;
+    snapshot * shots = calloc(count, sizeof(snapshot));
+    future ** done = calloc(count, sizeof(future *));
+    rects * dirty = rects_create(0);
+    // A thread per screen: the tasks spend their time helping the scheduler.
+    pool * p = pool_create(count, count);
+    scheduler * slices = scheduler_create(0);
+    int failed = 0;
+
+    for(int i = 0; i < count; i++) {
+        screen * s = src->screens->list[i];
+        shots[i].frame = source_grab(src, s, dirty);
+        shots[i].quality = quality;
+        shots[i].slices = slices;
+        snprintf(shots[i].path, sizeof(shots[i].path), "%s-%d.jpg", prefix, i);
+        if(shots[i].frame) {
+            done[i] = pool_submit(p, snapshot_encode, &shots[i]);
+        }
+    }
+    for(int i = 0; i < count; i++) {
+        if(done[i] && future_wait(p, done[i])) {
+            printf("%s: %s %dx%d, %lu bytes\n", shots[i].path, src->screens->list[i]->name,
+                   shots[i].frame->width, shots[i].frame->height, (unsigned long) shots[i].size);
+        } else {
+            printf("%s: failed\n", shots[i].path);
+            failed = 1;
+        }
+    }
 
-    /*
-      sock s = socket_create("192.168.1.42", 8000);
+    pool_release(p);
+    scheduler_release(slices);
+    rects_release(dirty);
+    free(done);
+    free(shots);
+    return failed;
+}
 
-      packet * pkt = read_packet(s);
+int main(int argc, char ** argv)
+{
+    int port = 8000;
+    int index = 0;
+    const char * prefix = NULL;
+    pipeline_config config;
+    memset(&config, 0, sizeof(config));
+    config.fps = 30;
+    config.sampling = TJE_SAMPLING_420;
+    source * src = NULL;
+
+    for(int i = 1; i < argc; i++) {
+        const char * arg = argv[i];
+        int more = argc - i - 1;
+        if(strcmp(arg, "-p") == 0 && more >= 1) {
+            port = atoi(argv[++i]);
+        } else if(strcmp(arg, "-s") == 0 && more >= 1) {
+            index = atoi(argv[++i]);
+        } else if(strcmp(arg, "-w") == 0 && more >= 1) {
+            config.width = atoi(argv[++i]);
+        } else if(strcmp(arg, "-h") == 0 && more >= 1) {
+            config.height = atoi(argv[++i]);
+        } else if(strcmp(arg, "-f") == 0 && more >= 1) {
+            config.fps = atoi(argv[++i]);
+        } else if(strcmp(arg, "-q") == 0 && more >= 1) {
+            config.quality = atoi(argv[++i]);
+        } else if(strcmp(arg, "-n") == 0 && more >= 1) {
+            config.in_flight = atoi(argv[++i]);
+        } else if(strcmp(arg, "-o") == 0 && more >= 1) {
+            prefix = argv[++i];
+        } else if(strcmp(arg, "--synthetic") == 0 && more >= 1 && src == NULL) {
+            const char * name = argv[++i];
+            synthetic_pattern pattern = strcmp(name, "text") == 0 ? SYNTHETIC_TEXT :
+                                        strcmp(name, "video") == 0 ? SYNTHETIC_VIDEO : SYNTHETIC_DESKTOP;
+            src = source_synthetic(1920, 1080, pattern);
+        } else if(strcmp(arg, "--replay") == 0 && more >= 3 && src == NULL) {
+            src = source_replay(argv[i + 1], atoi(argv[i + 2]), atoi(argv[i + 3]));
+            i += 3;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
 
-      printf("--%s\n",  pkt->boundary);
-      printf("Content-Type: %s\n",  pkt->type);
-      printf("Content-Length: %ld\n",  pkt->size);
-      printf("%s\n",  pkt->payload);
+    if(src == NULL) {
+        src = source_screens();
+    }
+    if(src != NULL && prefix != NULL) {
+        int failed = snapshot_screens(src, prefix, config.quality > 0 ? config.quality : 3);
+        source_release(src);
+        return failed;
+    }
+    if(src == NULL || index < 0 || index >= src->screens->count) {
+        printf("no screen %d\n", index);
+        return 1;
+    }
+    screen * s = src->screens->list[index];
+    printf("screen: %s %dx%d\n", s->name, s->width, s->height);
+
+    server * srv = server_create(port, "frame", 0);
+    if(srv == NULL) {
+        printf("can't listen on port %d\n", port);
+        source_release(src);
+        return 1;
+    }
 
-      write_packet(s, pkt);
+    pipeline * p = pipeline_create(src, s, &config, publish, poll_clients, srv);
+    pipeline_start(p);
+    printf("streaming on port %d, press enter to stop.\n", port);
 
-      free_packet(pkt);
+    fgetc(stdin);
 
-    */
-    screens * screens = screens_get();
-    for(int i = 0; i < screens->count; i++) {
-        printf("screen: %s %dx%d\n",screens->list[i]->name, screens->list[i]->width, screens->list[i]->height);
+    pipeline_stop(p);
+    pipeline_stats stats;
+    pipeline_get_stats(p, &stats);
+    printf("%lu frames, %lu unchanged, %.1f fps, %.0f KB/frame in %.1fs\n",
+           stats.frames, stats.unchanged, stats.frames / stats.elapsed,
+           stats.frames ? stats.bytes / 1024.0 / stats.frames : 0, stats.elapsed);
+    const char * stages[PIPELINE_STAGES] = { "capture", "resize", "encode", "send" };
+    for(int i = 0; i < PIPELINE_STAGES; i++) {
+        printf("%-8s %5.1f ms/frame\n", stages[i], stats.frames ? 1000 * stats.busy[i] / stats.frames : 0);
     }
 
-    fgetc(stdin);
+    pipeline_release(p);
+    server_release(srv);
+    source_release(src);
 
     return 0;
 }
@@ -7,17 +7,31 @@
 #include <stdio.h>
 //#pragma comment(lib, "ws2_32.lib")
 typedef SOCKET sock;
+#define SOCKET_INVALID INVALID_SOCKET
+#define SOCKET_SEND_FLAGS 0
 #else
 #include <netdb.h>
 #include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <string.h>
 #include <errno.h>
 #include <stdio.h>
+#include <fcntl.h>
 typedef int sock;
+#define SOCKET_INVALID -1
+#ifdef MSG_NOSIGNAL
+#define SOCKET_SEND_FLAGS MSG_NOSIGNAL  // Report EPIPE instead of raising SIGPIPE.
+#else
+#define SOCKET_SEND_FLAGS 0             // Sockets get SO_NOSIGPIPE instead.
+#endif
 #endif
 
+#include <stdlib.h>
+
 
 typedef struct _packet {
     char boundary[64];
@@ -29,19 +43,96 @@ typedef struct _packet {
 
 sock socket_create(const char * host, int port);
 
+// Listening socket on all interfaces, SOCKET_INVALID on error.
+sock socket_listen(int port);
+
+// SOCKET_INVALID when the listener is non-blocking and nobody is waiting.
+sock socket_accept(sock listener);
+
+void socket_set_nonblocking(sock s);
+
+// Whether the last failed call on a non-blocking socket only would have
+// blocked (or was interrupted) and can be retried later.
+int socket_would_block();
+
+// Closes a socket returned by socket_accept.
+void socket_close_peer(sock s);
+
 char socket_read(sock s);
 
+// Buffered reading: one recv fills up to `capacity` bytes that are then
+// handed out without further syscalls. Reads larger than the buffer go
+// straight to the destination.
+typedef struct _socket_reader {
+    sock s;
+    char * buffer;
+    int capacity;
+    int start;          // Ring buffer of `count` bytes starting at `start`.
+    int count;
+} socket_reader;
+
+#define SOCKET_READER_DEFAULT_SIZE 65536
+
+socket_reader * socket_reader_create(sock s, int capacity);
+
+// Next byte, 0 once the connection is closed or fails.
+char socket_reader_getc(socket_reader * r);
+
+// Reads exactly `size` bytes. Returns 0 if the connection ends first.
+int socket_reader_read(socket_reader * r, char * dest, int size);
+
+void socket_reader_release(socket_reader * r);
+
 void socket_write(sock s, char * buffer, int size);
 
+// One piece of a gathered write.
+typedef struct _socket_chunk {
+    const char * data;
+    size_t size;
+} socket_chunk;
+
+#define SOCKET_MAX_CHUNKS 16
+
+// Sends `count` chunks back to back with as few syscalls as possible
+// (sendmsg/WSASend), resuming after partial writes. Returns 0 on error.
+int socket_writev(sock s, const socket_chunk * chunks, int count);
+
 void socket_close(sock s);
 
-packet * read_packet(sock s);
+packet * read_packet(socket_reader * r);
 
 void write_packet(sock s, packet * p);
 
 void free_packet(packet * p);
 
-#endif
+// Reusable buffer for outgoing packets. The payload is written in place at
+// `payload`, for instance with tje_encoder_encode_to_memory(enc, &b->data,
+// &b->capacity, PACKET_HEADER_SPACE, pixels). write_packet_buffer prints the
+// multipart header into the space reserved in front of it, so header and
+// payload leave in a single send without the payload being copied.
+#define PACKET_HEADER_SPACE 256
+
+typedef struct _packet_buffer {
+    unsigned char * data;
+    size_t capacity;
+    size_t size;        // Payload bytes.
+} packet_buffer;
+
+packet_buffer * packet_buffer_create(size_t capacity);
+
+// Grows the buffer so that the payload can hold `size` bytes.
+int packet_buffer_reserve(packet_buffer * b, size_t size);
+
+unsigned char * packet_buffer_payload(packet_buffer * b);
+
+// Prints the multipart header in the space reserved in front of the payload,
+// ending right where it starts. Returns the header size, 0 if too long.
+int packet_buffer_frame(packet_buffer * b, const char * boundary, const char * type);
+
+void write_packet_buffer(sock s, packet_buffer * b, const char * boundary, const char * type);
+
+void packet_buffer_release(packet_buffer * b);
+
 
 #if defined(_WIN32) || defined(__MINGW32__) || defined(__MINGW64__)
 
@@ -86,12 +177,33 @@ char socket_read(sock s)
     return c[0];
 }
 
-void socket_write(sock s, char * buffer, int size)
+int socket_writev(sock s, const socket_chunk * chunks, int count)
 {
-    if(send(s, buffer, size, 0) == SOCKET_ERROR) {
-        _print_last_error();
+    WSABUF bufs[SOCKET_MAX_CHUNKS];
+    if(count > SOCKET_MAX_CHUNKS) {
+        return 0;
     }
-
+    for(int i = 0; i < count; i++) {
+        bufs[i].buf = (CHAR *) chunks[i].data;
+        bufs[i].len = (ULONG) chunks[i].size;
+    }
+    int first = 0;
+    while(first < count) {
+        DWORD sent = 0;
+        if(WSASend(s, bufs + first, count - first, &sent, 0, NULL, NULL) == SOCKET_ERROR) {
+            _print_last_error();
+            return 0;
+        }
+        while(first < count && sent >= bufs[first].len) {
+            sent -= bufs[first].len;
+            first++;
+        }
+        if(first < count) {
+            bufs[first].buf += sent;
+            bufs[first].len -= sent;
+        }
+    }
+    return 1;
 }
 
 void socket_close(sock s)
@@ -100,6 +212,52 @@ void socket_close(sock s)
     WSACleanup();
 }
 
+sock socket_listen(int port)
+{
+    WSADATA WSAData;
+    WSAStartup(MAKEWORD(2,0), &WSAData);
+    SOCKADDR_IN sin;
+    sock s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if(s == INVALID_SOCKET) {
+        _print_last_error();
+        return SOCKET_INVALID;
+    }
+    BOOL reuse = TRUE;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char *) &reuse, sizeof(reuse));
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_addr.s_addr = htonl(INADDR_ANY);
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    if(bind(s, (SOCKADDR *)&sin, sizeof(sin)) == SOCKET_ERROR || listen(s, SOMAXCONN) == SOCKET_ERROR) {
+        _print_last_error();
+        closesocket(s);
+        return SOCKET_INVALID;
+    }
+    return s;
+}
+
+sock socket_accept(sock listener)
+{
+    return accept(listener, NULL, NULL);
+}
+
+void socket_set_nonblocking(sock s)
+{
+    u_long on = 1;
+    ioctlsocket(s, FIONBIO, &on);
+}
+
+int socket_would_block()
+{
+    int err = WSAGetLastError();
+    return err == WSAEWOULDBLOCK || err == WSAEINTR;
+}
+
+void socket_close_peer(sock s)
+{
+    closesocket(s);
+}
+
 
 #else
 
@@ -108,6 +266,16 @@ void _print_last_error()
     printf("Error code %d:  %s\n",errno, strerror(errno));
 }
 
+// Without MSG_NOSIGNAL (macOS, BSD) a write to a closed peer would raise
+// SIGPIPE and kill the process, the socket option turns it into EPIPE.
+void _socket_no_sigpipe(sock s)
+{
+#if !defined(MSG_NOSIGNAL) && defined(SO_NOSIGPIPE)
+    int on = 1;
+    setsockopt(s, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+}
+
 sock socket_create(const char * host, int port)
 {
     struct sockaddr_in sin;
@@ -122,6 +290,7 @@ sock socket_create(const char * host, int port)
     if( connect(s, (struct sockaddr *)&sin, sizeof(sin)) < 0 ) {
         _print_last_error();
     }
+    _socket_no_sigpipe(s);
     return s;
 }
 
@@ -135,11 +304,61 @@ char socket_read(sock s)
     return c[0];
 }
 
-void socket_write(sock s, char * buffer, int size)
+void _socket_cork(sock s, int on)
 {
-    if(send(s, buffer, size, 0) < 0) {
-        _print_last_error();
+#ifdef TCP_CORK
+    setsockopt(s, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+#endif
+}
+
+int socket_writev(sock s, const socket_chunk * chunks, int count)
+{
+    struct iovec iov[SOCKET_MAX_CHUNKS];
+    struct msghdr msg;
+    if(count > SOCKET_MAX_CHUNKS) {
+        return 0;
+    }
+    for(int i = 0; i < count; i++) {
+        iov[i].iov_base = (void *) chunks[i].data;
+        iov[i].iov_len = chunks[i].size;
+    }
+    memset(&msg, 0, sizeof(msg));
+
+    // A single sendmsg queues the whole frame at once. Only when it comes
+    // back short is the socket corked, so that the rest does not leave in
+    // small segments, and uncorked once everything is queued.
+    int corked = 0;
+    int first = 0;
+    int ok = 1;
+    while(first < count) {
+        msg.msg_iov = iov + first;
+        msg.msg_iovlen = count - first;
+        ssize_t sent = sendmsg(s, &msg, SOCKET_SEND_FLAGS);
+        if(sent < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            _print_last_error();
+            ok = 0;
+            break;
+        }
+        while(first < count && (size_t) sent >= iov[first].iov_len) {
+            sent -= iov[first].iov_len;
+            first++;
+        }
+        if(first < count) {
+            iov[first].iov_base = (char *) iov[first].iov_base + sent;
+            iov[first].iov_len -= sent;
+            if(!corked) {
+                _socket_cork(s, 1);
+                corked = 1;
+            }
+        }
+    }
+    if(corked) {
+        _socket_cork(s, 0);
     }
+    return ok;
 }
 
 void socket_close(sock s)
@@ -147,52 +366,215 @@ void socket_close(sock s)
     close(s);
 }
 
+sock socket_listen(int port)
+{
+    struct sockaddr_in sin;
+    sock s = socket(AF_INET, SOCK_STREAM, 0);
+    if(s < 0) {
+        _print_last_error();
+        return SOCKET_INVALID;
+    }
+    int reuse = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_addr.s_addr = htonl(INADDR_ANY);
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    if(bind(s, (struct sockaddr *)&sin, sizeof(sin)) < 0 || listen(s, SOMAXCONN) < 0) {
+        _print_last_error();
+        close(s);
+        return SOCKET_INVALID;
+    }
+    return s;
+}
+
+sock socket_accept(sock listener)
+{
+    sock s = accept(listener, NULL, NULL);
+    if(s != SOCKET_INVALID) {
+        _socket_no_sigpipe(s);
+    }
+    return s;
+}
+
+void socket_set_nonblocking(sock s)
+{
+    int flags = fcntl(s, F_GETFL, 0);
+    fcntl(s, F_SETFL, flags | O_NONBLOCK);
+}
+
+int socket_would_block()
+{
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+void socket_close_peer(sock s)
+{
+    close(s);
+}
+
 #endif
 
-char * read_trimmed_line(sock s)
+void socket_write(sock s, char * buffer, int size)
+{
+    socket_chunk chunk;
+    chunk.data = buffer;
+    chunk.size = size;
+    socket_writev(s, &chunk, 1);
+}
+
+socket_reader * socket_reader_create(sock s, int capacity)
+{
+    socket_reader * r = calloc(1, sizeof(socket_reader));
+    if(capacity <= 0) {
+        capacity = SOCKET_READER_DEFAULT_SIZE;
+    }
+    r->s = s;
+    r->capacity = capacity;
+    r->buffer = malloc(capacity);
+    return r;
+}
+
+void socket_reader_release(socket_reader * r)
+{
+    free(r->buffer);
+    free(r);
+}
+
+// Receives into the free space after the buffered bytes, up to the end of
+// the ring. Returns the number of bytes received, 0 or less on close/error.
+int _socket_reader_fill(socket_reader * r)
+{
+    if(r->count == r->capacity) {
+        return 0;
+    }
+    if(r->count == 0) {
+        r->start = 0;
+    }
+    int end = (r->start + r->count) % r->capacity;
+    int space = end >= r->start ? r->capacity - end : r->start - end;
+    int res = recv(r->s, r->buffer + end, space, 0);
+    if(res < 0) {
+        _print_last_error();
+    }
+    if(res > 0) {
+        r->count += res;
+    }
+    return res;
+}
+
+// Moves up to `size` buffered bytes to `dest`, returns how many.
+int _socket_reader_take(socket_reader * r, char * dest, int size)
+{
+    int taken = 0;
+    while(taken < size && r->count > 0) {
+        int chunk = r->capacity - r->start;
+        if(chunk > r->count) chunk = r->count;
+        if(chunk > size - taken) chunk = size - taken;
+        memcpy(dest + taken, r->buffer + r->start, chunk);
+        r->start = (r->start + chunk) % r->capacity;
+        r->count -= chunk;
+        taken += chunk;
+    }
+    return taken;
+}
+
+char socket_reader_getc(socket_reader * r)
+{
+    if(r->count == 0 && _socket_reader_fill(r) <= 0) {
+        return 0;
+    }
+    char c = r->buffer[r->start];
+    r->start = (r->start + 1) % r->capacity;
+    r->count--;
+    return c;
+}
+
+int socket_reader_read(socket_reader * r, char * dest, int size)
 {
-    char c = socket_read(s);
+    int done = _socket_reader_take(r, dest, size);
+    while(done < size) {
+        int res;
+        if(size - done >= r->capacity) {
+            // Would not fit in the buffer anyway, skip the extra copy.
+            res = recv(r->s, dest + done, size - done, 0);
+            if(res < 0) {
+                _print_last_error();
+            }
+        } else {
+            res = _socket_reader_fill(r);
+            if(res > 0) {
+                res = _socket_reader_take(r, dest + done, size - done);
+            }
+        }
+        if(res <= 0) {
+            return 0;
+        }
+        done += res;
+    }
+    return 1;
+}
+
+char * read_trimmed_line(socket_reader * r)
+{
+    char c = socket_reader_getc(r);
     int ptr = 0;
     char buffer[1024];
-    while(c && ptr < 1024) {
+    while(c && ptr < 1023) {
         if(c == '\n') {
-            buffer[ptr] = '\0';
-            ptr++;
             break;
         }
         if(c == ' ' || c == '\r') {
-            c = socket_read(s);
+            c = socket_reader_getc(r);
             continue;
         }
         buffer[ptr] = c;
         ptr++;
-        c = socket_read(s);
+        c = socket_reader_getc(r);
+    }
+    buffer[ptr] = '\0';
+    char * line = malloc(ptr + 1);
+    if(line) {
+        memcpy(line, buffer, ptr + 1);
     }
-    char * line = malloc(ptr * sizeof(char));
-    strncpy(line, buffer, ptr);
     return line;
 
 }
 
-
-
-packet * read_packet(sock s)
+// Reads a header line and scans one field from it, returns 0 if the line
+// is missing or doesn't match.
+int _read_header(socket_reader * r, const char * format, void * field)
 {
-    char * line;
-    packet * pkt = malloc(sizeof(packet));
-    line = read_trimmed_line(s);
-    sscanf(line, "--%s",  pkt->boundary);
-    free(line);
-    line = read_trimmed_line(s);
-    sscanf(line, "Content-Type:%s",  pkt->type);
-    free(line);
-    line = read_trimmed_line(s);
-    sscanf(line, "Content-Length:%ld",  &pkt->size);
+    char * line = read_trimmed_line(r);
+    if(!line) {
+        return 0;
+    }
+    int res = line[0] && sscanf(line, format, field) == 1;
     free(line);
-    free(read_trimmed_line(s));
-    pkt->payload = malloc(pkt->size * sizeof(char));
-    for(int i = 0; i < pkt->size; i++) {
-        pkt->payload[i] = socket_read(s);
+    return res;
+}
+
+packet * read_packet(socket_reader * r)
+{
+    packet * pkt = calloc(1, sizeof(packet));
+    if(!pkt) {
+        return NULL;
+    }
+    // An empty boundary line is the end of the stream.
+    if(!_read_header(r, "--%63s", pkt->boundary) ||
+       !_read_header(r, "Content-Type:%127s", pkt->type) ||
+       !_read_header(r, "Content-Length:%ld", &pkt->size)) {
+        free(pkt);
+        return NULL;
+    }
+    free(read_trimmed_line(r));
+    if(pkt->size < 0) {
+        pkt->size = 0;
+    }
+    pkt->payload = malloc((pkt->size + 1) * sizeof(char));
+    if(!pkt->payload || !socket_reader_read(r, pkt->payload, (int) pkt->size)) {
+        free_packet(pkt);
+        return NULL;
     }
     pkt->payload[pkt->size] = '\0';
     return pkt;
@@ -200,15 +582,15 @@ packet * read_packet(sock s)
 
 void write_packet(sock s, packet * p)
 {
-    char buffer[1024];
-    int size = 0;
-    size = sprintf(buffer,"--%s\r\n", p->boundary);
-    socket_write(s, buffer , size);
-    size = sprintf(buffer,"Content-Type:%s\r\n", p->type);
-    socket_write(s, buffer , size);
-    size = sprintf(buffer,"Content-Length:%ld\r\n\r\n", p->size);
-    socket_write(s, buffer , size);
-    socket_write(s, p->payload , p->size);
+    char header[1024];
+    int size = snprintf(header, sizeof(header), "--%s\r\nContent-Type:%s\r\nContent-Length:%ld\r\n\r\n",
+                        p->boundary, p->type, p->size);
+    socket_chunk chunks[2];
+    chunks[0].data = header;
+    chunks[0].size = size;
+    chunks[1].data = p->payload;
+    chunks[1].size = p->size;
+    socket_writev(s, chunks, 2);
 }
 
 
@@ -218,3 +600,67 @@ void free_packet(packet * p)
     free(p);
 }
 
+
+packet_buffer * packet_buffer_create(size_t capacity)
+{
+    packet_buffer * b = calloc(1, sizeof(packet_buffer));
+    if(b && !packet_buffer_reserve(b, capacity)) {
+        free(b);
+        return NULL;
+    }
+    return b;
+}
+
+int packet_buffer_reserve(packet_buffer * b, size_t size)
+{
+    size_t needed = PACKET_HEADER_SPACE + size;
+    if(needed <= b->capacity) {
+        return 1;
+    }
+    unsigned char * data = realloc(b->data, needed);
+    if(data == NULL) {
+        return 0;
+    }
+    b->data = data;
+    b->capacity = needed;
+    return 1;
+}
+
+unsigned char * packet_buffer_payload(packet_buffer * b)
+{
+    return b->data + PACKET_HEADER_SPACE;
+}
+
+int packet_buffer_frame(packet_buffer * b, const char * boundary, const char * type)
+{
+    char header[PACKET_HEADER_SPACE];
+    int size = snprintf(header, sizeof(header), "--%s\r\nContent-Type:%s\r\nContent-Length:%ld\r\n\r\n",
+                        boundary, type, (long) b->size);
+    if(size < 0 || size >= PACKET_HEADER_SPACE) {
+        printf("Packet header too long\n");
+        return 0;
+    }
+    memcpy(b->data + PACKET_HEADER_SPACE - size, header, size);
+    return size;
+}
+
+void write_packet_buffer(sock s, packet_buffer * b, const char * boundary, const char * type)
+{
+    int size = packet_buffer_frame(b, boundary, type);
+    if(size == 0) {
+        return;
+    }
+    unsigned char * start = b->data + PACKET_HEADER_SPACE - size;
+    socket_chunk chunk;
+    chunk.data = (const char *) start;
+    chunk.size = size + b->size;
+    socket_writev(s, &chunk, 1);
+}
+
+void packet_buffer_release(packet_buffer * b)
+{
+    free(b->data);
+    free(b);
+}
+
+#endif
@@ -0,0 +1,430 @@
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+
+#include <stdlib.h>
+#include <string.h>
+#include "bitmap.h"
+#include "source.h"
+#include "resize.h"
+#include "network.h"
+#include "threads.h"
+#include "lock.h"
+#include "ring.h"
+
+#define TJE_IMPLEMENTATION
+#include "libs/tiny_jpeg.h"
+
+#if defined(_WIN32) || defined(__MINGW32__) || defined(__MINGW64__)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+// Streams one screen: capture -> resize -> encode -> send, each stage on its
+// own thread. Frames move between stages through SPSC rings, so frame N+1 is
+// captured while N is encoded and N-1 is sent, and the frame rate is set by
+// the slowest stage instead of the sum of all of them.
+//
+// Memory is bounded by `in_flight` frame slots allocated up front. Capture
+// waits for a free slot, so a slow sender holds back capture instead of
+// piling up frames. Each slot keeps its bitmaps and JPEG buffer between
+// frames, nothing is allocated per frame once the sizes are known.
+//
+// The sink runs on the send thread. It gets the JPEG at
+// packet_buffer_payload(packet), `packet->size` bytes, with
+// PACKET_HEADER_SPACE bytes in front for packet_buffer_frame, and may swap
+// the buffer memory (server_publish does).
+
+typedef void (*pipeline_sink)(void * context, packet_buffer * packet);
+
+// Called on the send thread when there is no frame to send, for at most
+// `timeout_ms`. Lets the sink drive its own I/O (server_poll). NULL sleeps.
+typedef void (*pipeline_idle)(void * context, int timeout_ms);
+
+typedef struct _pipeline_config {
+    int in_flight;          // Frame slots, 0 picks PIPELINE_DEFAULT_IN_FLIGHT.
+    int width;              // Stream size, 0 keeps the screen size. With only
+    int height;             // one side given the other follows the aspect ratio.
+    int fps;                // Capture rate cap, 0 runs as fast as the slowest stage.
+    int quality;            // tiny_jpeg quality, 1 to 3. 0 picks 3.
+    int sampling;           // TJE_SAMPLING_ value.
+    int threads;            // Encode and resize threads, 0 is one per CPU minus one.
+} pipeline_config;
+
+#define PIPELINE_DEFAULT_IN_FLIGHT 3
+#define PIPELINE_IDLE_MS 2
+#define PIPELINE_STAGES 4
+
+typedef enum _pipeline_stage {
+    PIPELINE_CAPTURE,
+    PIPELINE_RESIZE,
+    PIPELINE_ENCODE,
+    PIPELINE_SEND
+} pipeline_stage;
+
+typedef struct _pipeline_stats {
+    unsigned long frames;       // Sent.
+    unsigned long unchanged;    // Grabs with nothing dirty, not streamed.
+    unsigned long bytes;        // Of JPEG sent.
+    double busy[PIPELINE_STAGES];   // Seconds each stage spent working.
+    double elapsed;             // Seconds since pipeline_start.
+} pipeline_stats;
+
+// What one stage has done so far. Each stage only adds to its own, under
+// the pipeline's stats lock.
+typedef struct _pipeline_counters {
+    unsigned long frames;
+    unsigned long unchanged;
+    unsigned long bytes;
+    double busy;
+} pipeline_counters;
+
+typedef struct _pipeline_frame {
+    unsigned long number;
+    bitmap * capture;           // Copy of the grab, the source reuses its own.
+    bitmap * scaled;            // NULL when no resize is needed.
+    packet_buffer * packet;
+} pipeline_frame;
+
+// Hands frames from one stage thread to the next. `ready` wakes the
+// consumer, which only waits once the ring is empty.
+typedef struct _pipeline_queue {
+    spsc_ring * ring;
+    event * ready;
+} pipeline_queue;
+
+typedef struct _pipeline {
+    pipeline_config config;
+    source * src;
+    screen * screen;
+    pipeline_sink sink;
+    pipeline_idle idle;
+    void * context;
+    pipeline_frame * frames;
+    pipeline_queue queues[PIPELINE_STAGES];     // Input of each stage, capture's is the free list.
+    thread * threads[PIPELINE_STAGES];
+    resizer * resizer;
+    workers * resize_pool;
+    scheduler * encode_pool;
+    tje_encoder * encoder;
+    event * stopping;           // Manual reset, set by pipeline_stop.
+    int stop;
+    double started;
+    double elapsed;             // Set by pipeline_stop.
+    mutex * stats_lock;
+    pipeline_counters counters[PIPELINE_STAGES];
+} pipeline;
+
+
+// Streams `s` of `src` to `sink`. The source must outlive the pipeline.
+pipeline * pipeline_create(source * src, screen * s, const pipeline_config * config,
+                           pipeline_sink sink, pipeline_idle idle, void * context);
+
+// Starts the stage threads.
+void pipeline_start(pipeline * p);
+
+// Stops the stage threads, frames in flight are dropped.
+void pipeline_stop(pipeline * p);
+
+// Counters so far. Read while running they may be a frame apart.
+void pipeline_get_stats(pipeline * p, pipeline_stats * stats);
+
+void pipeline_release(pipeline * p);
+
+// Monotonic seconds.
+double pipeline_now();
+
+
+#if defined(_WIN32) || defined(__MINGW32__) || defined(__MINGW64__)
+
+double pipeline_now()
+{
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double) counter.QuadPart / frequency.QuadPart;
+}
+
+#else
+
+double pipeline_now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+#endif
+
+void _pipeline_put(pipeline * p, pipeline_stage stage, pipeline_frame * f)
+{
+    pipeline_queue * q = &p->queues[stage];
+    // Never full, the ring has room for every slot.
+    spsc_ring_push(q->ring, f);
+    event_set(q->ready);
+}
+
+// Next frame for `stage`, NULL once the pipeline stops.
+pipeline_frame * _pipeline_take(pipeline * p, pipeline_stage stage)
+{
+    pipeline_queue * q = &p->queues[stage];
+    for(;;) {
+        if(__atomic_load_n(&p->stop, __ATOMIC_ACQUIRE)) {
+            return NULL;
+        }
+        pipeline_frame * f = spsc_ring_pop(q->ring);
+        if(f != NULL) {
+            return f;
+        }
+        event_wait(q->ready);
+    }
+}
+
+// Adds the time since `t0` and the given counts to the counters of `stage`.
+// Only called from the thread of that stage.
+void _pipeline_count(pipeline * p, pipeline_stage stage, double t0,
+                     unsigned long frames, unsigned long bytes, unsigned long unchanged)
+{
+    double busy = pipeline_now() - t0;
+    pipeline_counters * c = &p->counters[stage];
+    mutex_lock(p->stats_lock);
+    c->frames += frames;
+    c->bytes += bytes;
+    c->unchanged += unchanged;
+    c->busy += busy;
+    mutex_unlock(p->stats_lock);
+}
+
+void _pipeline_copy(bitmap * dst, bitmap * src)
+{
+    if(dst->stride == src->stride) {
+        memcpy(dst->data, src->data, (size_t) src->stride * src->height);
+        return;
+    }
+    for(int y = 0; y < src->height; y++) {
+        memcpy(dst->data + (size_t) y * dst->stride, src->data + (size_t) y * src->stride, (size_t) src->width * BITMAP_BPP);
+    }
+}
+
+void _pipeline_capture(void * arg)
+{
+    pipeline * p = arg;
+    rects * dirty = rects_create(0);
+    double interval = p->config.fps > 0 ? 1.0 / p->config.fps : 0;
+    double next = pipeline_now();
+    unsigned long number = 0;
+
+    // An unchanged grab keeps its slot for the next one, the free list only
+    // takes frames back from the send thread.
+    pipeline_frame * f = NULL;
+    while(!__atomic_load_n(&p->stop, __ATOMIC_ACQUIRE)) {
+        if(f == NULL && (f = _pipeline_take(p, PIPELINE_CAPTURE)) == NULL) {
+            break;
+        }
+        double wait = next - pipeline_now();
+        if(wait > 0 && event_wait_timeout(p->stopping, (int)(wait * 1000) + 1)) {
+            break;
+        }
+        next = (wait > 0 ? next : pipeline_now()) + interval;
+
+        double t0 = pipeline_now();
+        bitmap * b = source_grab(p->src, p->screen, dirty);
+        if(b == NULL || (dirty->count == 0 && number > 0)) {
+            // Viewers already have this picture, the server replays the
+            // latest frame to new ones.
+            _pipeline_count(p, PIPELINE_CAPTURE, t0, 0, 0, b != NULL);
+            if(interval == 0 && event_wait_timeout(p->stopping, PIPELINE_IDLE_MS)) {
+                break;
+            }
+            continue;
+        }
+        if(f->capture == NULL || f->capture->width != b->width || f->capture->height != b->height) {
+            // Only the first frames of each slot, screens don't resize
+            // under a running pipeline.
+            if(f->capture) bitmap_release(f->capture);
+            f->capture = bitmap_create(b->width, b->height);
+        }
+        _pipeline_copy(f->capture, b);
+        f->number = number++;
+        _pipeline_count(p, PIPELINE_CAPTURE, t0, 0, 0, 0);
+        _pipeline_put(p, PIPELINE_RESIZE, f);
+        f = NULL;
+    }
+    rects_release(dirty);
+}
+
+void _pipeline_resize(void * arg)
+{
+    pipeline * p = arg;
+    pipeline_frame * f;
+    while((f = _pipeline_take(p, PIPELINE_RESIZE)) != NULL) {
+        int width = p->config.width;
+        int height = p->config.height;
+        // A single given side keeps the aspect ratio.
+        if(width <= 0) width = height > 0 ? (int)((long) f->capture->width * height / f->capture->height) : f->capture->width;
+        if(height <= 0) height = (int)((long) f->capture->height * width / f->capture->width);
+        if(width != f->capture->width || height != f->capture->height) {
+            double t0 = pipeline_now();
+            if(p->resizer == NULL) {
+                p->resizer = resizer_create(f->capture->width, f->capture->height, width, height, STBIR_FILTER_DEFAULT);
+            }
+            if(f->scaled == NULL) {
+                f->scaled = bitmap_create(width, height);
+            }
+            resizer_run_parallel(p->resizer, f->capture, f->scaled, p->resize_pool, 0);
+            _pipeline_count(p, PIPELINE_RESIZE, t0, 0, 0, 0);
+        }
+        _pipeline_put(p, PIPELINE_ENCODE, f);
+    }
+}
+
+void _pipeline_encode(void * arg)
+{
+    pipeline * p = arg;
+    pipeline_frame * f;
+    while((f = _pipeline_take(p, PIPELINE_ENCODE)) != NULL) {
+        double t0 = pipeline_now();
+        bitmap * b = f->scaled ? f->scaled : f->capture;
+        if(p->encoder == NULL) {
+            // A slice per thread and a half, so a late slice doesn't leave
+            // the others idle.
+            int mcu_height = p->config.sampling == TJE_SAMPLING_420 ? 16 : 8;
+            int mcu_rows = (b->height + mcu_height - 1) / mcu_height;
+            int slices = (p->encode_pool->count + 1) * 3 / 2;
+            int slice_rows = slices > 1 ? (mcu_rows + slices - 1) / slices : 0;
+            p->encoder = tje_encoder_create(p->config.quality, p->config.sampling, b->width, b->height,
+                                            TJE_FORMAT_BGRX, b->stride, slice_rows,
+                                            scheduler_parallel, p->encode_pool);
+            // Desktops change a little between frames, most blocks repeat.
+            tje_encoder_cache_blocks(p->encoder, 1);
+        }
+        f->packet->size = tje_encoder_encode_to_memory(p->encoder, &f->packet->data, &f->packet->capacity,
+                                                       PACKET_HEADER_SPACE, (const unsigned char *) b->data);
+        _pipeline_count(p, PIPELINE_ENCODE, t0, 0, 0, 0);
+        _pipeline_put(p, PIPELINE_SEND, f);
+    }
+}
+
+void _pipeline_send(void * arg)
+{
+    pipeline * p = arg;
+    pipeline_queue * q = &p->queues[PIPELINE_SEND];
+    while(!__atomic_load_n(&p->stop, __ATOMIC_ACQUIRE)) {
+        pipeline_frame * f = spsc_ring_pop(q->ring);
+        if(f == NULL) {
+            // The sink's I/O and new frames can't be waited on together, so
+            // the idle call is kept short.
+            if(p->idle) {
+                p->idle(p->context, PIPELINE_IDLE_MS);
+            } else {
+                event_wait_timeout(q->ready, PIPELINE_IDLE_MS);
+            }
+            continue;
+        }
+        double t0 = pipeline_now();
+        // The sink may swap the buffer.
+        size_t size = f->packet->size;
+        if(size > 0) {
+            p->sink(p->context, f->packet);
+        }
+        _pipeline_count(p, PIPELINE_SEND, t0, size > 0, size, 0);
+        _pipeline_put(p, PIPELINE_CAPTURE, f);
+    }
+}
+
+pipeline * pipeline_create(source * src, screen * s, const pipeline_config * config,
+                           pipeline_sink sink, pipeline_idle idle, void * context)
+{
+    pipeline * p = calloc(1, sizeof(pipeline));
+    p->config = *config;
+    if(p->config.in_flight <= 0) p->config.in_flight = PIPELINE_DEFAULT_IN_FLIGHT;
+    if(p->config.quality <= 0) p->config.quality = 3;
+    p->src = src;
+    p->screen = s;
+    p->sink = sink;
+    p->idle = idle;
+    p->context = context;
+
+    int in_flight = p->config.in_flight;
+    for(int i = 0; i < PIPELINE_STAGES; i++) {
+        p->queues[i].ring = spsc_ring_create(in_flight);
+        p->queues[i].ready = event_create(0);
+    }
+    p->frames = calloc(in_flight, sizeof(pipeline_frame));
+    for(int i = 0; i < in_flight; i++) {
+        p->frames[i].packet = packet_buffer_create(0);
+        spsc_ring_push(p->queues[PIPELINE_CAPTURE].ring, &p->frames[i]);
+    }
+
+    p->resize_pool = workers_create(p->config.threads);
+    p->encode_pool = scheduler_create(p->config.threads);
+    p->stopping = event_create(1);
+    p->stats_lock = mutex_create();
+    return p;
+}
+
+void pipeline_start(pipeline * p)
+{
+    runnable_arg stages[PIPELINE_STAGES] = { _pipeline_capture, _pipeline_resize, _pipeline_encode, _pipeline_send };
+    p->started = pipeline_now();
+    for(int i = 0; i < PIPELINE_STAGES; i++) {
+        p->threads[i] = thread_start(stages[i], p);
+    }
+}
+
+void pipeline_stop(pipeline * p)
+{
+    if(p->threads[0] == NULL) {
+        return;
+    }
+    p->elapsed = pipeline_now() - p->started;
+    __atomic_store_n(&p->stop, 1, __ATOMIC_RELEASE);
+    event_set(p->stopping);
+    for(int i = 0; i < PIPELINE_STAGES; i++) {
+        event_set(p->queues[i].ready);
+    }
+    for(int i = 0; i < PIPELINE_STAGES; i++) {
+        thread_join(p->threads[i]);
+        thread_release(p->threads[i]);
+        p->threads[i] = NULL;
+    }
+}
+
+void pipeline_get_stats(pipeline * p, pipeline_stats * stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    mutex_lock(p->stats_lock);
+    stats->frames = p->counters[PIPELINE_SEND].frames;
+    stats->bytes = p->counters[PIPELINE_SEND].bytes;
+    stats->unchanged = p->counters[PIPELINE_CAPTURE].unchanged;
+    for(int i = 0; i < PIPELINE_STAGES; i++) {
+        stats->busy[i] = p->counters[i].busy;
+    }
+    mutex_unlock(p->stats_lock);
+    stats->elapsed = p->threads[0] != NULL ? pipeline_now() - p->started : p->elapsed;
+}
+
+void pipeline_release(pipeline * p)
+{
+    pipeline_stop(p);
+    for(int i = 0; i < p->config.in_flight; i++) {
+        pipeline_frame * f = &p->frames[i];
+        if(f->capture) bitmap_release(f->capture);
+        if(f->scaled) bitmap_release(f->scaled);
+        packet_buffer_release(f->packet);
+    }
+    free(p->frames);
+    for(int i = 0; i < PIPELINE_STAGES; i++) {
+        spsc_ring_release(p->queues[i].ring);
+        event_release(p->queues[i].ready);
+    }
+    if(p->encoder) tje_encoder_release(p->encoder);
+    if(p->resizer) resizer_release(p->resizer);
+    workers_release(p->resize_pool);
+    scheduler_release(p->encode_pool);
+    event_release(p->stopping);
+    mutex_release(p->stats_lock);
+    free(p);
+}
+
+#endif
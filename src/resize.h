@@ -0,0 +1,575 @@
+#ifndef __RESIZE_H__
+#define __RESIZE_H__
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "bitmap.h"
+#include "threads.h"
+
+// The vendored stb code has unused variables and functions, keep -Wall
+// quiet about them without touching it.
+#if defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-variable"
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+#define STB_IMAGE_RESIZE_IMPLEMENTATION
+#include "libs/stb_image_resize.h"
+#if defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define RESIZE_SSE2 1
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define RESIZE_AVX2 1
+#define RESIZE_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+// Resize context for a fixed (source size, destination size, filter). The
+// filter contributors, coefficients and scratch buffers that stbir_resize
+// computes and allocates on every call are set up once in resizer_create;
+// resizer_run only streams pixels through them.
+//
+// Downscales (the capture-to-stream case) do not go through stb at all but
+// through a separable 8 bit fixed point filter with the same kernels,
+// vectorized with SSE2 and, when the CPU has it, AVX2. Its output is on
+// average within a fraction of a level of stb's float path, and a few levels
+// off on hard edges where the 8 bit intermediate clamps the filter overshoot
+// (checked by bench/resize.c).
+
+// Fixed point weights of one axis: output pixel i reads `taps` source pixels
+// starting at first[i], weighted by weights[i * taps ...] in 1.14.
+typedef struct _resize_kernel {
+    int taps;
+    int * first;
+    int16_t * weights;
+} resize_kernel;
+
+#define RESIZE_PRECISION 14
+// Beyond that (downscales over ~60x) the stb path is used.
+#define RESIZE_MAX_TAPS 256
+
+typedef struct _resizer {
+    int src_width;
+    int src_height;
+    int dst_width;
+    int dst_height;
+    stbir_filter filter;
+    stbir__info info;
+    void * memory;
+    size_t memory_size;
+    // Set when the fixed point path is used. Clear it to force the stb path.
+    int fixed;
+    resize_kernel horizontal_kernel;
+    resize_kernel vertical_kernel;
+    // Horizontal pass output: dst_width x src_height.
+    bitmap * scratch;
+    // stb contexts for each band of resizer_run_parallel, when not fixed.
+    int bands;
+    struct _resizer ** band_resizers;
+} resizer;
+
+
+// `filter` is one of STBIR_FILTER_*, STBIR_FILTER_DEFAULT picks Mitchell for
+// downscaling and Catmull-Rom for upscaling like stb does.
+resizer * resizer_create(int src_width, int src_height, int dst_width, int dst_height, stbir_filter filter);
+
+// `src` and `dst` must have the sizes given to resizer_create.
+int resizer_run(resizer * r, bitmap * src, bitmap * dst);
+
+// Same as resizer_run, with the frame cut into `bands` horizontal bands that
+// run on `pool` and write straight into `dst`. `bands` <= 0 uses one band per
+// pool thread plus the caller.
+int resizer_run_parallel(resizer * r, bitmap * src, bitmap * dst, workers * pool, int bands);
+
+void resizer_release(resizer * r);
+
+
+// Builds the weights of a downscale from `src_size` to `dst_size` with the
+// same kernel placement as stb, edge pixels clamped. Returns 0 when the
+// filter does not fit the source (tiny images).
+int resize_kernel_init(resize_kernel * k, stbir_filter filter, int src_size, int dst_size)
+{
+    float scale = (float) dst_size / src_size;
+    float support = stbir__filter_info_table[filter].support(scale);
+    int taps = (int) ceil(2 * support / scale) + 2;
+    taps += taps & 1;  // SIMD loops consume taps in pairs.
+    if(taps > src_size || taps > RESIZE_MAX_TAPS) {
+        return 0;
+    }
+
+    float * weights = malloc(taps * sizeof(float));
+    k->taps = taps;
+    k->first = malloc(dst_size * sizeof(int));
+    k->weights = calloc((size_t) dst_size * taps, sizeof(int16_t));
+
+    for(int i = 0; i < dst_size; i++) {
+        float center = (i + 0.5f) / scale - 0.5f;
+        int lo = (int) floor(center - support / scale);
+        int hi = (int) ceil(center + support / scale);
+        int first = lo < 0 ? 0 : lo;
+        if(first + taps > src_size) {
+            first = src_size - taps;
+        }
+        float total = 0;
+        memset(weights, 0, taps * sizeof(float));
+        for(int n = lo; n <= hi; n++) {
+            float w = stbir__filter_info_table[filter].kernel(((n + 0.5f) * scale) - (i + 0.5f), scale);
+            int clamped = n < 0 ? 0 : (n >= src_size ? src_size - 1 : n);
+            weights[clamped - first] += w;
+            total += w;
+        }
+
+        int16_t * out = &k->weights[(size_t) i * taps];
+        int sum = 0, largest = 0;
+        for(int t = 0; t < taps; t++) {
+            out[t] = (int16_t) floor(weights[t] / total * (1 << RESIZE_PRECISION) + 0.5f);
+            sum += out[t];
+            if(abs(out[t]) > abs(out[largest])) largest = t;
+        }
+        // Rounding leftovers go to the heaviest tap so every row sums to 1.
+        out[largest] += (int16_t)((1 << RESIZE_PRECISION) - sum);
+        k->first[i] = first;
+    }
+    free(weights);
+    return 1;
+}
+
+void resize_kernel_free(resize_kernel * k)
+{
+    free(k->first);
+    free(k->weights);
+}
+
+uint8_t resize_clamp(int32_t v)
+{
+    v >>= RESIZE_PRECISION;
+    return (uint8_t)(v < 0 ? 0 : (v > 255 ? 255 : v));
+}
+
+void resize_horizontal_c(resize_kernel * k, const uint8_t * src, uint8_t * dst, int x0, int x1)
+{
+    for(int x = x0; x < x1; x++) {
+        const uint8_t * in = src + k->first[x] * BITMAP_BPP;
+        const int16_t * w = &k->weights[(size_t) x * k->taps];
+        int32_t acc[BITMAP_BPP] = { 1 << (RESIZE_PRECISION - 1), 1 << (RESIZE_PRECISION - 1),
+                                    1 << (RESIZE_PRECISION - 1), 1 << (RESIZE_PRECISION - 1)
+                                  };
+        for(int t = 0; t < k->taps; t++) {
+            for(int c = 0; c < BITMAP_BPP; c++) acc[c] += in[t * BITMAP_BPP + c] * w[t];
+        }
+        for(int c = 0; c < BITMAP_BPP; c++) dst[x * BITMAP_BPP + c] = resize_clamp(acc[c]);
+    }
+}
+
+void resize_vertical_c(const int16_t * w, int taps, const uint8_t ** rows, uint8_t * dst, int b0, int b1)
+{
+    for(int b = b0; b < b1; b++) {
+        int32_t acc = 1 << (RESIZE_PRECISION - 1);
+        for(int t = 0; t < taps; t++) acc += rows[t][b] * w[t];
+        dst[b] = resize_clamp(acc);
+    }
+}
+
+#ifdef RESIZE_SSE2
+
+// Two taps per step: the two source pixels are interleaved channel by
+// channel so that one pmaddwd applies both weights.
+void resize_horizontal_sse2(resize_kernel * k, const uint8_t * src, uint8_t * dst, int width)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32(1 << (RESIZE_PRECISION - 1));
+    for(int x = 0; x < width; x++) {
+        const uint8_t * in = src + k->first[x] * BITMAP_BPP;
+        const int16_t * w = &k->weights[(size_t) x * k->taps];
+        __m128i acc = round;
+        for(int t = 0; t < k->taps; t += 2) {
+            __m128i pixels = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(in + t * BITMAP_BPP)), zero);
+            __m128i pairs = _mm_unpacklo_epi16(pixels, _mm_srli_si128(pixels, 8));
+            __m128i weight = _mm_set1_epi32((uint16_t) w[t] | ((int32_t) w[t + 1] << 16));
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(pairs, weight));
+        }
+        acc = _mm_srai_epi32(acc, RESIZE_PRECISION);
+        acc = _mm_packs_epi32(acc, acc);
+        acc = _mm_packus_epi16(acc, acc);
+        *(int32_t *)(dst + x * BITMAP_BPP) = _mm_cvtsi128_si32(acc);
+    }
+}
+
+// 16 bytes of the output row per step, two source rows per pmaddwd.
+int resize_vertical_sse2(const int16_t * w, int taps, const uint8_t ** rows, uint8_t * dst, int b, int bytes)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32(1 << (RESIZE_PRECISION - 1));
+    for(; b + 16 <= bytes; b += 16) {
+        __m128i acc0 = round, acc1 = round, acc2 = round, acc3 = round;
+        for(int t = 0; t < taps; t += 2) {
+            __m128i r0 = _mm_loadu_si128((const __m128i *)(rows[t] + b));
+            __m128i r1 = _mm_loadu_si128((const __m128i *)(rows[t + 1] + b));
+            __m128i weight = _mm_set1_epi32((uint16_t) w[t] | ((int32_t) w[t + 1] << 16));
+            __m128i lo = _mm_unpacklo_epi8(r0, r1);
+            __m128i hi = _mm_unpackhi_epi8(r0, r1);
+            acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), weight));
+            acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), weight));
+            acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), weight));
+            acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), weight));
+        }
+        acc0 = _mm_packs_epi32(_mm_srai_epi32(acc0, RESIZE_PRECISION), _mm_srai_epi32(acc1, RESIZE_PRECISION));
+        acc2 = _mm_packs_epi32(_mm_srai_epi32(acc2, RESIZE_PRECISION), _mm_srai_epi32(acc3, RESIZE_PRECISION));
+        _mm_storeu_si128((__m128i *)(dst + b), _mm_packus_epi16(acc0, acc2));
+    }
+    return b;
+}
+
+#endif
+
+#ifdef RESIZE_AVX2
+
+// Same as the SSE2 version with one output pixel in each 128 bit lane.
+RESIZE_TARGET_AVX2
+void resize_horizontal_avx2(resize_kernel * k, const uint8_t * src, uint8_t * dst, int width)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i round = _mm256_set1_epi32(1 << (RESIZE_PRECISION - 1));
+    int x = 0;
+    for(; x + 2 <= width; x += 2) {
+        const uint8_t * in0 = src + k->first[x] * BITMAP_BPP;
+        const uint8_t * in1 = src + k->first[x + 1] * BITMAP_BPP;
+        const int16_t * w0 = &k->weights[(size_t) x * k->taps];
+        const int16_t * w1 = w0 + k->taps;
+        __m256i acc = round;
+        for(int t = 0; t < k->taps; t += 2) {
+            __m256i pixels = _mm256_inserti128_si256(
+                                 _mm256_castsi128_si256(_mm_loadl_epi64((const __m128i *)(in0 + t * BITMAP_BPP))),
+                                 _mm_loadl_epi64((const __m128i *)(in1 + t * BITMAP_BPP)), 1);
+            pixels = _mm256_unpacklo_epi8(pixels, zero);
+            __m256i pairs = _mm256_unpacklo_epi16(pixels, _mm256_srli_si256(pixels, 8));
+            __m256i weight = _mm256_inserti128_si256(
+                                 _mm256_castsi128_si256(_mm_set1_epi32((uint16_t) w0[t] | ((int32_t) w0[t + 1] << 16))),
+                                 _mm_set1_epi32((uint16_t) w1[t] | ((int32_t) w1[t + 1] << 16)), 1);
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(pairs, weight));
+        }
+        acc = _mm256_srai_epi32(acc, RESIZE_PRECISION);
+        acc = _mm256_packs_epi32(acc, acc);
+        acc = _mm256_packus_epi16(acc, acc);
+        *(int32_t *)(dst + x * BITMAP_BPP) = _mm_cvtsi128_si32(_mm256_castsi256_si128(acc));
+        *(int32_t *)(dst + (x + 1) * BITMAP_BPP) = _mm_cvtsi128_si32(_mm256_extracti128_si256(acc, 1));
+    }
+    resize_horizontal_c(k, src, dst, x, width);
+}
+
+RESIZE_TARGET_AVX2
+int resize_vertical_avx2(const int16_t * w, int taps, const uint8_t ** rows, uint8_t * dst, int b, int bytes)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i round = _mm256_set1_epi32(1 << (RESIZE_PRECISION - 1));
+    for(; b + 32 <= bytes; b += 32) {
+        __m256i acc0 = round, acc1 = round, acc2 = round, acc3 = round;
+        for(int t = 0; t < taps; t += 2) {
+            __m256i r0 = _mm256_loadu_si256((const __m256i *)(rows[t] + b));
+            __m256i r1 = _mm256_loadu_si256((const __m256i *)(rows[t + 1] + b));
+            __m256i weight = _mm256_set1_epi32((uint16_t) w[t] | ((int32_t) w[t + 1] << 16));
+            __m256i lo = _mm256_unpacklo_epi8(r0, r1);
+            __m256i hi = _mm256_unpackhi_epi8(r0, r1);
+            acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_unpacklo_epi8(lo, zero), weight));
+            acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(_mm256_unpackhi_epi8(lo, zero), weight));
+            acc2 = _mm256_add_epi32(acc2, _mm256_madd_epi16(_mm256_unpacklo_epi8(hi, zero), weight));
+            acc3 = _mm256_add_epi32(acc3, _mm256_madd_epi16(_mm256_unpackhi_epi8(hi, zero), weight));
+        }
+        acc0 = _mm256_packs_epi32(_mm256_srai_epi32(acc0, RESIZE_PRECISION), _mm256_srai_epi32(acc1, RESIZE_PRECISION));
+        acc2 = _mm256_packs_epi32(_mm256_srai_epi32(acc2, RESIZE_PRECISION), _mm256_srai_epi32(acc3, RESIZE_PRECISION));
+        _mm256_storeu_si256((__m256i *)(dst + b), _mm256_packus_epi16(acc0, acc2));
+    }
+    return b;
+}
+
+// -1 until detected. Setting it to 0 forces the SSE2 path (see
+// bench/resize.c).
+int resize_avx2 = -1;
+
+int resize_has_avx2()
+{
+    int has = __atomic_load_n(&resize_avx2, __ATOMIC_RELAXED);
+    if(has < 0) {
+        __builtin_cpu_init();
+        has = __builtin_cpu_supports("avx2") ? 1 : 0;
+        __atomic_store_n(&resize_avx2, has, __ATOMIC_RELAXED);
+    }
+    return has;
+}
+
+#endif
+
+void resize_horizontal(resize_kernel * k, const uint8_t * src, uint8_t * dst, int width)
+{
+#if defined(RESIZE_AVX2)
+    if(resize_has_avx2()) {
+        resize_horizontal_avx2(k, src, dst, width);
+        return;
+    }
+#endif
+#if defined(RESIZE_SSE2)
+    resize_horizontal_sse2(k, src, dst, width);
+#else
+    resize_horizontal_c(k, src, dst, 0, width);
+#endif
+}
+
+void resize_vertical(const int16_t * w, int taps, const uint8_t ** rows, uint8_t * dst, int bytes)
+{
+    int done = 0;
+#if defined(RESIZE_AVX2)
+    if(resize_has_avx2()) {
+        done = resize_vertical_avx2(w, taps, rows, dst, done, bytes);
+    }
+#endif
+#if defined(RESIZE_SSE2)
+    done = resize_vertical_sse2(w, taps, rows, dst, done, bytes);
+#endif
+    resize_vertical_c(w, taps, rows, dst, done, bytes);
+}
+
+void resize_fixed_rows(resizer * r, bitmap * src, int y0, int y1)
+{
+    for(int y = y0; y < y1; y++) {
+        resize_horizontal(&r->horizontal_kernel,
+                          (const uint8_t *) src->data + (size_t) y * src->stride,
+                          (uint8_t *) r->scratch->data + (size_t) y * r->scratch->stride,
+                          r->dst_width);
+    }
+}
+
+void resize_fixed_columns(resizer * r, bitmap * dst, int y0, int y1)
+{
+    resize_kernel * k = &r->vertical_kernel;
+    const uint8_t * rows[RESIZE_MAX_TAPS];
+    for(int y = y0; y < y1; y++) {
+        for(int t = 0; t < k->taps; t++) {
+            rows[t] = (const uint8_t *) r->scratch->data + (size_t)(k->first[y] + t) * r->scratch->stride;
+        }
+        resize_vertical(&k->weights[(size_t) y * k->taps], k->taps, rows,
+                        (uint8_t *) dst->data + (size_t) y * dst->stride, r->dst_width * BITMAP_BPP);
+    }
+}
+
+// stb context producing rows [t0, t1) (fractions of the full output) of a
+// src -> dst resize.
+resizer * resizer_create_region(int src_width, int src_height, int dst_width, int dst_height,
+                                stbir_filter filter, float t0, float t1)
+{
+    resizer * r = calloc(1, sizeof(resizer));
+    stbir__info * info = &r->info;
+
+    r->src_width = src_width;
+    r->src_height = src_height;
+    r->dst_width = dst_width;
+    r->dst_height = dst_height;
+    r->filter = filter;
+
+    stbir__setup(info, src_width, src_height, dst_width, dst_height, BITMAP_BPP);
+    stbir__calculate_transform(info, 0, t0, 1, t1, NULL);
+    stbir__choose_filter(info, filter, filter);
+    r->memory_size = stbir__calculate_memory(info);
+    r->memory = calloc(1, r->memory_size);
+
+    // The fourth byte of a BGRX pixel is padding, not alpha.
+    info->alpha_channel = STBIR_ALPHA_CHANNEL_NONE;
+    info->flags = STBIR_FLAG_ALPHA_USES_COLORSPACE | STBIR_FLAG_ALPHA_PREMULTIPLIED;
+    info->type = STBIR_TYPE_UINT8;
+    info->edge_horizontal = STBIR_EDGE_CLAMP;
+    info->edge_vertical = STBIR_EDGE_CLAMP;
+    info->colorspace = STBIR_COLORSPACE_LINEAR;
+
+    info->horizontal_coefficient_width   = stbir__get_coefficient_width  (info->horizontal_filter, info->horizontal_scale);
+    info->vertical_coefficient_width     = stbir__get_coefficient_width  (info->vertical_filter  , info->vertical_scale  );
+    info->horizontal_filter_pixel_width  = stbir__get_filter_pixel_width (info->horizontal_filter, info->horizontal_scale);
+    info->vertical_filter_pixel_width    = stbir__get_filter_pixel_width (info->vertical_filter  , info->vertical_scale  );
+    info->horizontal_filter_pixel_margin = stbir__get_filter_pixel_margin(info->horizontal_filter, info->horizontal_scale);
+    info->vertical_filter_pixel_margin   = stbir__get_filter_pixel_margin(info->vertical_filter  , info->vertical_scale  );
+
+    info->ring_buffer_length_bytes = info->output_w * info->channels * sizeof(float);
+    info->decode_buffer_pixels = info->input_w + info->horizontal_filter_pixel_margin * 2;
+
+    // Same layout as stbir__resize_allocated.
+    unsigned char * ptr = (unsigned char *) r->memory;
+    info->horizontal_contributors = (stbir__contributors *) ptr;
+    ptr += info->horizontal_contributors_size;
+    info->horizontal_coefficients = (float *) ptr;
+    ptr += info->horizontal_coefficients_size;
+    info->vertical_contributors = (stbir__contributors *) ptr;
+    ptr += info->vertical_contributors_size;
+    info->vertical_coefficients = (float *) ptr;
+    ptr += info->vertical_coefficients_size;
+    info->decode_buffer = (float *) ptr;
+    ptr += info->decode_buffer_size;
+    if(stbir__use_height_upsampling(info)) {
+        info->horizontal_buffer = NULL;
+        info->ring_buffer = (float *) ptr;
+        info->encode_buffer = (float *)(ptr + info->ring_buffer_size);
+    } else {
+        info->horizontal_buffer = (float *) ptr;
+        info->ring_buffer = (float *)(ptr + info->horizontal_buffer_size);
+        info->encode_buffer = NULL;
+    }
+
+    stbir__calculate_filters(info, info->horizontal_contributors, info->horizontal_coefficients,
+                             info->horizontal_filter, info->horizontal_scale, info->horizontal_shift,
+                             info->input_w, info->output_w);
+    stbir__calculate_filters(info, info->vertical_contributors, info->vertical_coefficients,
+                             info->vertical_filter, info->vertical_scale, info->vertical_shift,
+                             info->input_h, info->output_h);
+    return r;
+}
+
+resizer * resizer_create(int src_width, int src_height, int dst_width, int dst_height, stbir_filter filter)
+{
+    resizer * r = resizer_create_region(src_width, src_height, dst_width, dst_height, filter, 0, 1);
+    stbir__info * info = &r->info;
+
+    if(dst_width <= src_width && dst_height <= src_height) {
+        r->fixed = resize_kernel_init(&r->horizontal_kernel, info->horizontal_filter, src_width, dst_width);
+        if(r->fixed) {
+            r->fixed = resize_kernel_init(&r->vertical_kernel, info->vertical_filter, src_height, dst_height);
+            if(!r->fixed) {
+                resize_kernel_free(&r->horizontal_kernel);
+            }
+        }
+        if(r->fixed) {
+            r->scratch = bitmap_create(dst_width, src_height);
+        }
+    }
+    return r;
+}
+
+int resizer_run(resizer * r, bitmap * src, bitmap * dst)
+{
+    stbir__info * info = &r->info;
+
+    if(src->width != r->src_width || src->height != r->src_height ||
+            dst->width != r->dst_width || dst->height != r->dst_height) {
+        return 0;
+    }
+
+    if(r->fixed) {
+        resize_fixed_rows(r, src, 0, r->src_height);
+        resize_fixed_columns(r, dst, 0, r->dst_height);
+        return 1;
+    }
+
+    info->input_data = src->data;
+    info->input_stride_bytes = src->stride;
+    info->output_data = dst->data;
+    info->output_stride_bytes = dst->stride;
+
+    // Empty ring buffer, everything else is rewritten per scanline.
+    info->ring_buffer_begin_index = -1;
+    info->ring_buffer_first_scanline = 0;
+    info->ring_buffer_last_scanline = 0;
+
+    if(stbir__use_height_upsampling(info)) {
+        stbir__buffer_loop_upsample(info);
+    } else {
+        stbir__buffer_loop_downsample(info);
+    }
+    return 1;
+}
+
+typedef struct _resize_job {
+    resizer * r;
+    bitmap * src;
+    bitmap * dst;
+    int bands;
+} resize_job;
+
+void resize_rows_band(void * arg, int index)
+{
+    resize_job * job = (resize_job *) arg;
+    int h = job->r->src_height;
+    resize_fixed_rows(job->r, job->src, h * index / job->bands, h * (index + 1) / job->bands);
+}
+
+void resize_columns_band(void * arg, int index)
+{
+    resize_job * job = (resize_job *) arg;
+    int h = job->r->dst_height;
+    resize_fixed_columns(job->r, job->dst, h * index / job->bands, h * (index + 1) / job->bands);
+}
+
+void resize_region_band(void * arg, int index)
+{
+    resize_job * job = (resize_job *) arg;
+    int h = job->r->dst_height;
+    int y0 = h * index / job->bands;
+    bitmap band = *job->dst;
+    band.height = h * (index + 1) / job->bands - y0;
+    band.data += (size_t) y0 * band.stride;
+    resizer_run(job->r->band_resizers[index], job->src, &band);
+}
+
+int resizer_run_parallel(resizer * r, bitmap * src, bitmap * dst, workers * pool, int bands)
+{
+    resize_job job;
+
+    if(src->width != r->src_width || src->height != r->src_height ||
+            dst->width != r->dst_width || dst->height != r->dst_height) {
+        return 0;
+    }
+    if(bands <= 0) {
+        bands = pool->count + 1;
+    }
+    if(bands > r->dst_height) {
+        bands = r->dst_height;
+    }
+
+    job.r = r;
+    job.src = src;
+    job.dst = dst;
+    job.bands = bands;
+
+    if(r->fixed) {
+        // The vertical pass of a band reads scratch rows computed by its
+        // neighbours, so both passes are run to completion one after the other.
+        workers_run(pool, resize_rows_band, &job, bands);
+        workers_run(pool, resize_columns_band, &job, bands);
+        return 1;
+    }
+
+    if(r->bands != bands) {
+        for(int i = 0; i < r->bands; i++) {
+            resizer_release(r->band_resizers[i]);
+        }
+        free(r->band_resizers);
+        r->bands = bands;
+        r->band_resizers = malloc(bands * sizeof(resizer*));
+        for(int i = 0; i < bands; i++) {
+            int y0 = r->dst_height * i / bands;
+            int y1 = r->dst_height * (i + 1) / bands;
+            r->band_resizers[i] = resizer_create_region(r->src_width, r->src_height, r->dst_width, y1 - y0,
+                                  r->filter, (float) y0 / r->dst_height, (float) y1 / r->dst_height);
+        }
+    }
+    workers_run(pool, resize_region_band, &job, bands);
+    return 1;
+}
+
+void resizer_release(resizer * r)
+{
+    for(int i = 0; i < r->bands; i++) {
+        resizer_release(r->band_resizers[i]);
+    }
+    free(r->band_resizers);
+    if(r->scratch) {
+        resize_kernel_free(&r->horizontal_kernel);
+        resize_kernel_free(&r->vertical_kernel);
+        bitmap_release(r->scratch);
+    }
+    free(r->memory);
+    free(r);
+}
+
+#endif
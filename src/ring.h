@@ -0,0 +1,180 @@
+#ifndef __RING_H__
+#define __RING_H__
+
+#include <stdlib.h>
+#include <stdint.h>
+
+// Lock-free bounded rings of pointers, to hand frames from one pipeline
+// stage to the next without a lock:
+//
+//  - spsc_ring: one producer thread, one consumer thread.
+//  - mpmc_ring: any number of both (D. Vyukov's bounded queue, one sequence
+//    number per cell).
+//
+// Push fails when the ring is full and pop returns NULL when it is empty,
+// neither ever blocks. NULL can't be pushed. The capacity is rounded up to a
+// power of two. Producer and consumer indices sit on separate cache lines so
+// the two sides don't keep stealing the line from each other.
+//
+// Uses the GCC/clang __atomic builtins (gcc, clang and mingw).
+
+#define RING_CACHE_LINE 64
+
+typedef struct _spsc_ring {
+    size_t head;            // Next slot to pop, written by the consumer.
+    size_t tail_cache;      // Consumer's last look at `tail`.
+    char pad0[RING_CACHE_LINE - 2 * sizeof(size_t)];
+    size_t tail;            // Next slot to push, written by the producer.
+    size_t head_cache;      // Producer's last look at `head`.
+    char pad1[RING_CACHE_LINE - 2 * sizeof(size_t)];
+    size_t mask;
+    void ** items;
+} spsc_ring;
+
+typedef struct _mpmc_cell {
+    size_t sequence;
+    void * item;
+} mpmc_cell;
+
+typedef struct _mpmc_ring {
+    size_t enqueue;
+    char pad0[RING_CACHE_LINE - sizeof(size_t)];
+    size_t dequeue;
+    char pad1[RING_CACHE_LINE - sizeof(size_t)];
+    size_t mask;
+    mpmc_cell * cells;
+} mpmc_ring;
+
+
+spsc_ring * spsc_ring_create(size_t capacity);
+
+int spsc_ring_push(spsc_ring * r, void * item);
+
+void * spsc_ring_pop(spsc_ring * r);
+
+void spsc_ring_release(spsc_ring * r);
+
+mpmc_ring * mpmc_ring_create(size_t capacity);
+
+int mpmc_ring_push(mpmc_ring * r, void * item);
+
+void * mpmc_ring_pop(mpmc_ring * r);
+
+void mpmc_ring_release(mpmc_ring * r);
+
+
+size_t ring_round_up(size_t capacity)
+{
+    size_t size = 2;
+    while(size < capacity) size *= 2;
+    return size;
+}
+
+spsc_ring * spsc_ring_create(size_t capacity)
+{
+    spsc_ring * r = calloc(1, sizeof(spsc_ring));
+    size_t size = ring_round_up(capacity);
+    r->mask = size - 1;
+    r->items = calloc(size, sizeof(void *));
+    return r;
+}
+
+int spsc_ring_push(spsc_ring * r, void * item)
+{
+    size_t tail = r->tail;
+    if(tail - r->head_cache > r->mask) {
+        // Looks full, the consumer may have moved on since.
+        r->head_cache = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        if(tail - r->head_cache > r->mask) {
+            return 0;
+        }
+    }
+    r->items[tail & r->mask] = item;
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+void * spsc_ring_pop(spsc_ring * r)
+{
+    size_t head = r->head;
+    if(head == r->tail_cache) {
+        r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        if(head == r->tail_cache) {
+            return NULL;
+        }
+    }
+    void * item = r->items[head & r->mask];
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    return item;
+}
+
+void spsc_ring_release(spsc_ring * r)
+{
+    free(r->items);
+    free(r);
+}
+
+mpmc_ring * mpmc_ring_create(size_t capacity)
+{
+    mpmc_ring * r = calloc(1, sizeof(mpmc_ring));
+    size_t size = ring_round_up(capacity);
+    r->mask = size - 1;
+    r->cells = malloc(size * sizeof(mpmc_cell));
+    for(size_t i = 0; i < size; i++) {
+        r->cells[i].sequence = i;
+        r->cells[i].item = NULL;
+    }
+    return r;
+}
+
+// A cell is free for the push at position `pos` when its sequence is `pos`,
+// and holds the item for the pop at `pos` when it is `pos + 1`.
+int mpmc_ring_push(mpmc_ring * r, void * item)
+{
+    size_t pos = __atomic_load_n(&r->enqueue, __ATOMIC_RELAXED);
+    for(;;) {
+        mpmc_cell * cell = &r->cells[pos & r->mask];
+        size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t) sequence - (intptr_t) pos;
+        if(diff == 0) {
+            if(__atomic_compare_exchange_n(&r->enqueue, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                cell->item = item;
+                __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+                return 1;
+            }
+        } else if(diff < 0) {
+            return 0;
+        } else {
+            pos = __atomic_load_n(&r->enqueue, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void * mpmc_ring_pop(mpmc_ring * r)
+{
+    size_t pos = __atomic_load_n(&r->dequeue, __ATOMIC_RELAXED);
+    for(;;) {
+        mpmc_cell * cell = &r->cells[pos & r->mask];
+        size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t) sequence - (intptr_t)(pos + 1);
+        if(diff == 0) {
+            if(__atomic_compare_exchange_n(&r->dequeue, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                void * item = cell->item;
+                __atomic_store_n(&cell->sequence, pos + r->mask + 1, __ATOMIC_RELEASE);
+                return item;
+            }
+        } else if(diff < 0) {
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&r->dequeue, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void mpmc_ring_release(mpmc_ring * r)
+{
+    free(r->cells);
+    free(r);
+}
+
+#endif
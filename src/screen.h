@@ -2,12 +2,18 @@
 #define __SCREEN_H__
 
 //#include "monitor.h"
+#include "bitmap.h"
+#include "tiles.h"
+#include "resize.h"
 
 typedef struct _screen {
 
     char * name;
+    int x;
+    int y;
     int width;
     int height;
+    void * data;
 
 } screen;
 
@@ -16,17 +22,35 @@ typedef struct _screens {
     screen ** list;
 } screens;
 
-typedef char * bitmap;
-
 
 screens* screens_get();
 
+// The returned bitmap belongs to the screen and is overwritten by the next
+// grab of the same screen. Do not release it.
 bitmap * screens_grab(screen * s);
 
+// Same as screens_grab, but also fills `dirty` with the regions that changed
+// since the previous call for this screen. When nothing changed the previous
+// bitmap is returned untouched and dirty->count is 0. Platforms without damage
+// reporting fall back to tile hashing (see tiles.h), or report the whole
+// screen when the grab itself is not implemented.
+bitmap * screens_grab_damage(screen * s, rects * dirty);
+
+// Returns a new bitmap (release it with bitmap_release). Resize contexts are
+// cached per source and destination size, so repeated calls for the same
+// stream size do no setup work.
 bitmap * screens_resize(bitmap * src, int width, int height);
 
+// Same as screens_resize, into `dst` at its own size, so a stream that keeps
+// its destination bitmap allocates nothing per frame.
+//
+// The context cache behind both calls is not locked: call them from one
+// thread only. Parallel streams should each own a resizer (resize.h).
+void screens_resize_into(bitmap * src, bitmap * dst);
+
+void screens_release(screens * s);
+
 
-#endif
 
 #if defined(_WIN32) || defined(__MINGW32__) || defined(__MINGW64__)
 
@@ -62,7 +86,7 @@ bool get_settings(DEVMODEW *settings, WCHAR *parent, int index)
 
 screen *get_screen(DISPLAY_DEVICEW *adapter, DISPLAY_DEVICEW *display)
 {
-    screen *screen = malloc(sizeof(screen));
+    screen *screen = malloc(sizeof(*screen));
     DEVMODEW current;
 
     screen->name = calloc(128, sizeof(char));
@@ -70,8 +94,11 @@ screen *get_screen(DISPLAY_DEVICEW *adapter, DISPLAY_DEVICEW *display)
     for(int i=0; i<128; ++i)screen->name[i] = (name[i]<128)? name[i]: '?';
 
     get_settings(&current, adapter->DeviceName, ENUM_CURRENT_SETTINGS);
+    screen->x = current.dmPosition.x;
+    screen->y = current.dmPosition.y;
     screen->width = current.dmPelsWidth;
     screen->height = current.dmPelsHeight;
+    screen->data = NULL;
 
     return screen;
 }
@@ -133,10 +160,21 @@ bitmap * screens_grab(screen * s)
     return NULL;
 }
 
-bitmap * screens_resize(bitmap * src, int width, int height)
+bitmap * screens_grab_damage(screen * s, rects * dirty)
 {
+    rects_clear(dirty);
+    rects_add(dirty, 0, 0, s->width, s->height);
+    return screens_grab(s);
+}
 
-    return NULL;
+void screens_release(screens * s)
+{
+    for(int i = 0; i < s->count; i++) {
+        free(s->list[i]->name);
+        free(s->list[i]);
+    }
+    free(s->list);
+    free(s);
 }
 
 
@@ -146,6 +184,7 @@ bitmap * screens_resize(bitmap * src, int width, int height)
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <dlfcn.h>
 #include <ApplicationServices/ApplicationServices.h>
 #include <IOKit/graphics/IOGraphicsLib.h>
@@ -161,7 +200,8 @@ char * get_screen_name(CGDirectDisplayID display)
     CFDictionaryRef names = CFDictionaryGetValue(info, CFSTR(kDisplayProductName));
     CFStringRef value;
     if(names == NULL || !CFDictionaryGetValueIfPresent(names, CFSTR("en_US"), (const void**) &value)) {
-        name = "Unknown";
+        name = calloc(8, sizeof(char));
+        strcpy(name, "Unknown");
     } else {
         CFIndex size = CFStringGetMaximumSizeForEncoding(CFStringGetLength(value),
                        kCFStringEncodingASCII);
@@ -185,8 +225,12 @@ screens* screens_get()
     screens->list =  malloc(display_count * sizeof(screen));
 
     for(int i=0; i<display_count; ++i) {
-        screen * screen = malloc(sizeof(screen));
+        screen * screen = malloc(sizeof(*screen));
         screen->name = get_screen_name(display_ids[i]);
+        CGRect bounds = CGDisplayBounds(display_ids[i]);
+        screen->x = (int)bounds.origin.x;
+        screen->y = (int)bounds.origin.y;
+        screen->data = NULL;
         CGDisplayModeRef current_mode = CGDisplayCopyDisplayMode(display_ids[i]);
         screen->width = (int)CGDisplayModeGetWidth(current_mode);
         screen->height = (int)CGDisplayModeGetHeight(current_mode);
@@ -203,20 +247,63 @@ bitmap * screens_grab(screen * s)
     return NULL;
 }
 
-bitmap * screens_resize(bitmap * src, int width, int height)
+bitmap * screens_grab_damage(screen * s, rects * dirty)
 {
+    rects_clear(dirty);
+    rects_add(dirty, 0, 0, s->width, s->height);
+    return screens_grab(s);
+}
 
-    return NULL;
+void screens_release(screens * s)
+{
+    for(int i = 0; i < s->count; i++) {
+        free(s->list[i]->name);
+        free(s->list[i]);
+    }
+    free(s->list);
+    free(s);
 }
 
 
 #else
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
 #include <X11/Xlib.h>
+#include <X11/Xutil.h>
 #include <X11/Xatom.h>
 #include <X11/extensions/Xrandr.h>
 #include <X11/extensions/Xinerama.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xfixes.h>
+#include <X11/extensions/Xdamage.h>
+
+// Shared by screens_get and every grab, the capture path never reopens it.
+Display * _display = NULL;
+
+// Per screen capture state: one XImage (and shared memory segment when
+// MIT-SHM is available) allocated on the first grab and reused afterwards.
+typedef struct _x11_capture {
+    XImage * image;
+    XShmSegmentInfo shm;
+    int use_shm;
+    bitmap frame;
+    // Damage accumulated for this screen since its last screens_grab_damage.
+    XserverRegion pending;
+    int has_pending;
+    struct _x11_capture * next;
+    // Only used when the server has no DAMAGE extension.
+    tiles * tiles;
+} x11_capture;
+
+// One damage object on the root window feeds every screen. Damage is moved
+// out of the server object into the pending region of each capture so that
+// screens can be polled independently.
+Damage _damage = None;
+int _damage_event_base = -1;
+x11_capture * _damage_captures = NULL;
 
 char *copy_str(char *string)
 {
@@ -224,34 +311,51 @@ char *copy_str(char *string)
     int count = 0;
     while(string[count] != 0) ++count;
 
-    copy = calloc(count, sizeof(char));
+    copy = calloc(count + 1, sizeof(char));
     for(; count>=0; --count) copy[count]=string[count];
     return copy;
 }
 
+Display * get_display()
+{
+    if(_display == NULL) {
+        _display = XOpenDisplay(NULL);
+    }
+    return _display;
+}
+
 
 screens* screens_get()
 {
-    Display * display = XOpenDisplay(NULL);
+    Display * display = get_display();
     Window root = XRootWindow(display, XDefaultScreen(display));
     int scr_count = 0;
 
     XRRScreenResources *screen_resources = XRRGetScreenResources(display, root);
-    screens * screens = malloc(screen_resources->ncrtc * sizeof(screens));
+    screens * screens = malloc(sizeof(*screens));
+    screens->list = malloc(screen_resources->ncrtc * sizeof(screen*));
     for(int i=0; i<screen_resources->ncrtc; ++i) {
         RRCrtc crtc = screen_resources->crtcs[i];
         XRRCrtcInfo *crtc_info = XRRGetCrtcInfo(display, screen_resources, crtc);
-        RROutput output = crtc_info->outputs[i];
+        if(crtc_info->mode == None || crtc_info->noutput == 0) {
+            XRRFreeCrtcInfo(crtc_info);
+            continue;
+        }
+        RROutput output = crtc_info->outputs[0];
         XRROutputInfo *output_info = XRRGetOutputInfo(display, screen_resources, output);
         if(output_info->connection == RR_Connected) {
-            screen *screen = malloc(sizeof(screen));
-            screen->name = copy_str(output_info->name);
-            screen->width =	crtc_info->width;
-            screen->height = crtc_info->height;
-            screens->list[scr_count] = screen;
+            screen *scr = malloc(sizeof(screen));
+            scr->name = copy_str(output_info->name);
+            scr->x = crtc_info->x;
+            scr->y = crtc_info->y;
+            scr->width = crtc_info->width;
+            scr->height = crtc_info->height;
+            scr->data = NULL;
+            screens->list[scr_count] = scr;
             scr_count++;
         }
 
+        XRRFreeOutputInfo(output_info);
         XRRFreeCrtcInfo(crtc_info);
     }
     screens-> count = scr_count ;
@@ -259,16 +363,257 @@ screens* screens_get()
     return screens;
 }
 
+// Setting it to 0 before the first grab forces the XGetSubImage path (see
+// bench/capture.c).
+int capture_shm = 1;
+
+int _shm_attach_failed = 0;
+
+int _shm_attach_error(Display * display, XErrorEvent * error)
+{
+    _shm_attach_failed = 1;
+    return 0;
+}
+
+// XShmAttach reports failure (BadAccess on a remote or containerized
+// server) as an asynchronous X error, which would exit the process through
+// the default handler. Catch it around the round trip instead.
+int capture_attach(Display * display, XShmSegmentInfo * shm)
+{
+    XSync(display, False);
+    _shm_attach_failed = 0;
+    int (*previous)(Display *, XErrorEvent *) = XSetErrorHandler(_shm_attach_error);
+    Status attached = XShmAttach(display, shm);
+    XSync(display, False);
+    XSetErrorHandler(previous);
+    return attached && !_shm_attach_failed;
+}
+
+x11_capture * capture_create(Display * display, screen * s)
+{
+    int scr = XDefaultScreen(display);
+    Visual * visual = XDefaultVisual(display, scr);
+    int depth = XDefaultDepth(display, scr);
+    x11_capture * cap = calloc(1, sizeof(x11_capture));
+
+    cap->use_shm = capture_shm && XShmQueryExtension(display);
+    if(cap->use_shm) {
+        cap->image = XShmCreateImage(display, visual, depth, ZPixmap, NULL,
+                                     &cap->shm, s->width, s->height);
+        if(cap->image == NULL) {
+            cap->use_shm = 0;
+        }
+    }
+    if(cap->use_shm) {
+        cap->shm.shmid = shmget(IPC_PRIVATE,
+                                cap->image->bytes_per_line * cap->image->height,
+                                IPC_CREAT | 0600);
+        if(cap->shm.shmid < 0) {
+            XDestroyImage(cap->image);
+            cap->use_shm = 0;
+        } else {
+            cap->shm.shmaddr = shmat(cap->shm.shmid, NULL, 0);
+            cap->shm.readOnly = False;
+            int attached = cap->shm.shmaddr != (char *) -1;
+            if(attached) {
+                cap->image->data = cap->shm.shmaddr;
+                attached = capture_attach(display, &cap->shm);
+                if(!attached) {
+                    shmdt(cap->shm.shmaddr);
+                }
+            }
+            // Mark for removal now, the segment lives until the last detach.
+            shmctl(cap->shm.shmid, IPC_RMID, NULL);
+            if(!attached) {
+                // Fall back to XGetSubImage below.
+                cap->image->data = NULL;
+                XDestroyImage(cap->image);
+                cap->use_shm = 0;
+            }
+        }
+    }
+    if(!cap->use_shm) {
+        // Without MIT-SHM the image is still allocated once and refilled in
+        // place with XGetSubImage.
+        cap->image = XCreateImage(display, visual, depth, ZPixmap, 0, NULL,
+                                  s->width, s->height, 32, 0);
+        if(cap->image == NULL) {
+            free(cap);
+            return NULL;
+        }
+        cap->image->data = malloc(cap->image->bytes_per_line * cap->image->height);
+        if(cap->image->data == NULL) {
+            XDestroyImage(cap->image);
+            free(cap);
+            return NULL;
+        }
+    }
+
+    cap->frame.width = s->width;
+    cap->frame.height = s->height;
+    cap->frame.stride = cap->image->bytes_per_line;
+    cap->frame.data = cap->image->data;
+    return cap;
+}
+
+void capture_release(Display * display, x11_capture * cap)
+{
+    if(cap->pending != None) {
+        x11_capture ** it = &_damage_captures;
+        while(*it != cap) it = &(*it)->next;
+        *it = cap->next;
+        XFixesDestroyRegion(display, cap->pending);
+    }
+    if(cap->tiles) {
+        tiles_release(cap->tiles);
+    }
+    if(cap->use_shm) {
+        XShmDetach(display, &cap->shm);
+        XSync(display, False);
+        shmdt(cap->shm.shmaddr);
+        cap->image->data = NULL;
+    }
+    XDestroyImage(cap->image);
+    free(cap);
+}
+
 bitmap * screens_grab(screen * s)
 {
+    Display * display = get_display();
+    Window root = XRootWindow(display, XDefaultScreen(display));
+    if(s->data == NULL) {
+        s->data = capture_create(display, s);
+        if(s->data == NULL) {
+            return NULL;
+        }
+    }
+    x11_capture * cap = (x11_capture *) s->data;
 
-    return NULL;
+    if(cap->use_shm) {
+        if(!XShmGetImage(display, root, cap->image, s->x, s->y, AllPlanes)) {
+            return NULL;
+        }
+    } else if(!XGetSubImage(display, root, s->x, s->y, s->width, s->height,
+                            AllPlanes, ZPixmap, cap->image, 0, 0)) {
+        return NULL;
+    }
+    return &cap->frame;
 }
 
-bitmap * screens_resize(bitmap * src, int width, int height)
+int damage_init(Display * display)
 {
+    int fixes_base, damage_base, error_base;
+    if(_damage_event_base == -1) {
+        _damage_event_base = -2;
+        if(XFixesQueryExtension(display, &fixes_base, &error_base) &&
+                XDamageQueryExtension(display, &damage_base, &error_base)) {
+            _damage = XDamageCreate(display, XRootWindow(display, XDefaultScreen(display)),
+                                    XDamageReportNonEmpty);
+            _damage_event_base = damage_base;
+        }
+    }
+    return _damage_event_base >= 0;
+}
 
-    return NULL;
+void damage_collect(Display * display)
+{
+    XEvent event;
+    int damaged = 0;
+    while(XPending(display)) {
+        XNextEvent(display, &event);
+        if(event.type == _damage_event_base + XDamageNotify) {
+            damaged = 1;
+        }
+    }
+    if(!damaged) {
+        return;
+    }
+
+    XserverRegion region = XFixesCreateRegion(display, NULL, 0);
+    XDamageSubtract(display, _damage, None, region);
+    for(x11_capture * cap = _damage_captures; cap; cap = cap->next) {
+        XFixesUnionRegion(display, cap->pending, cap->pending, region);
+        cap->has_pending = 1;
+    }
+    XFixesDestroyRegion(display, region);
+}
+
+bitmap * screens_grab_damage(screen * s, rects * dirty)
+{
+    Display * display = get_display();
+    rects_clear(dirty);
+
+    if(s->data == NULL) {
+        s->data = capture_create(display, s);
+        if(s->data == NULL) {
+            return NULL;
+        }
+    }
+    x11_capture * cap = (x11_capture *) s->data;
+
+    if(!damage_init(display)) {
+        bitmap * frame = screens_grab(s);
+        if(frame == NULL) {
+            return NULL;
+        }
+        if(cap->tiles == NULL) {
+            cap->tiles = tiles_create(s->width, s->height, TILES_DEFAULT_SIZE);
+        }
+        tiles_diff(cap->tiles, frame, dirty);
+        return frame;
+    }
+
+    if(cap->pending == None) {
+        // First frame for this screen: everything is dirty.
+        cap->pending = XFixesCreateRegion(display, NULL, 0);
+        cap->next = _damage_captures;
+        _damage_captures = cap;
+        damage_collect(display);
+        XFixesSetRegion(display, cap->pending, NULL, 0);
+        cap->has_pending = 0;
+        rects_add(dirty, 0, 0, s->width, s->height);
+        return screens_grab(s);
+    }
+
+    damage_collect(display);
+    if(!cap->has_pending) {
+        return &cap->frame;
+    }
+
+    XRectangle bounds = { s->x, s->y, s->width, s->height };
+    XserverRegion clip = XFixesCreateRegion(display, &bounds, 1);
+    XFixesIntersectRegion(display, clip, clip, cap->pending);
+    XFixesSetRegion(display, cap->pending, NULL, 0);
+    cap->has_pending = 0;
+
+    int count = 0;
+    XRectangle * list = XFixesFetchRegion(display, clip, &count);
+    for(int i = 0; i < count; i++) {
+        rects_add(dirty, list[i].x - s->x, list[i].y - s->y, list[i].width, list[i].height);
+    }
+    if(list) {
+        XFree(list);
+    }
+    XFixesDestroyRegion(display, clip);
+
+    if(dirty->count == 0) {
+        return &cap->frame;
+    }
+    return screens_grab(s);
+}
+
+void screens_release(screens * s)
+{
+    Display * display = get_display();
+    for(int i = 0; i < s->count; i++) {
+        if(s->list[i]->data) {
+            capture_release(display, s->list[i]->data);
+        }
+        free(s->list[i]->name);
+        free(s->list[i]);
+    }
+    free(s->list);
+    free(s);
 }
 
 
@@ -276,4 +621,47 @@ bitmap * screens_resize(bitmap * src, int width, int height)
 
 
 
+#endif
+
+#define SCREENS_RESIZERS 4
+
+resizer * _resizers[SCREENS_RESIZERS];
+
+void screens_resize_into(bitmap * src, bitmap * dst)
+{
+    int width = dst->width;
+    int height = dst->height;
+    resizer * r = NULL;
+    int slot = SCREENS_RESIZERS - 1;
+    for(int i = 0; i < SCREENS_RESIZERS; i++) {
+        resizer * it = _resizers[i];
+        if(it && it->src_width == src->width && it->src_height == src->height &&
+                it->dst_width == width && it->dst_height == height) {
+            r = it;
+            slot = i;
+            break;
+        }
+    }
+    if(r == NULL) {
+        if(_resizers[slot]) {
+            resizer_release(_resizers[slot]);
+        }
+        r = resizer_create(src->width, src->height, width, height, STBIR_FILTER_DEFAULT);
+    }
+    // Keep the most recently used context first.
+    for(int i = slot; i > 0; i--) {
+        _resizers[i] = _resizers[i - 1];
+    }
+    _resizers[0] = r;
+
+    resizer_run(r, src, dst);
+}
+
+bitmap * screens_resize(bitmap * src, int width, int height)
+{
+    bitmap * dst = bitmap_create(width, height);
+    screens_resize_into(src, dst);
+    return dst;
+}
+
 #endif
@@ -0,0 +1,479 @@
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#if defined(_WIN32) || defined(__MINGW32__) || defined(__MINGW64__)
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600  // WSAPoll needs Vista.
+#endif
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "network.h"
+
+// MJPEG over HTTP for any number of viewers. Every client gets a
+// multipart/x-mixed-replace stream made of the usual packet framing. A frame
+// is published once and the same bytes are sent to every client, clients
+// only hold a reference and their own send offset.
+//
+// Each client has a queue of at most `queue_depth` frames waiting behind the
+// one being sent. A client that falls behind so far that its queue is full
+// skips the frames waiting there and goes straight to the newest one: slow
+// viewers get a lower frame rate, they never hold up capture or the other
+// viewers. The frame being sent is always finished, the stream stays valid.
+//
+// Sockets are non-blocking and multiplexed with epoll on Linux, poll or
+// WSAPoll elsewhere. A server is driven by one thread: server_publish and
+// server_poll must not be called concurrently.
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#define SERVER_EPOLL 1
+#elif defined(_WIN32) || defined(__MINGW32__) || defined(__MINGW64__)
+typedef WSAPOLLFD server_pollfd;
+#define server_poll_fds WSAPoll
+#else
+#include <poll.h>
+typedef struct pollfd server_pollfd;
+#define server_poll_fds poll
+#endif
+
+// One published frame: multipart header and payload, shared by clients.
+typedef struct _server_frame {
+    unsigned char * data;
+    size_t capacity;
+    size_t start;
+    size_t size;
+    int refs;
+} server_frame;
+
+typedef enum _server_client_state {
+    SERVER_CLIENT_REQUEST,  // Reading the HTTP request.
+    SERVER_CLIENT_STREAM    // Response header sent or queued, sending frames.
+} server_client_state;
+
+typedef struct _server_client_stats {
+    unsigned long sent;         // Frames sent completely.
+    unsigned long dropped;      // Frames skipped because the client was behind.
+    unsigned long long bytes;
+} server_client_stats;
+
+typedef struct _server_client {
+    sock s;
+    server_client_state state;
+    char request[1024];
+    int request_size;
+    size_t response_offset;
+    server_frame * current;     // Being sent, from `offset`.
+    size_t offset;
+    server_frame ** queue;      // Ring of `count` frames from `head`.
+    int head;
+    int count;
+    int writing;                // Registered for write readiness.
+    server_client_stats stats;
+} server_client;
+
+typedef struct _server {
+    sock listener;
+    char boundary[64];
+    char response[256];
+    size_t response_size;
+    server_client ** clients;
+    int count;
+    int capacity;
+    int queue_depth;
+    server_frame * latest;      // Sent first to new clients.
+    unsigned char * spare;      // Memory of a released frame, for reuse.
+    size_t spare_capacity;
+#ifdef SERVER_EPOLL
+    int epoll;
+#endif
+} server;
+
+
+#define SERVER_DEFAULT_QUEUE_DEPTH 2
+
+// Listens on `port`. `queue_depth` frames can wait for each client, 0 picks
+// SERVER_DEFAULT_QUEUE_DEPTH. NULL if the port can't be bound.
+server * server_create(int port, const char * boundary, int queue_depth);
+
+// Sends the `b->size` bytes at packet_buffer_payload(b) to every client.
+// The server takes over the memory of `b` and hands it the memory of an
+// older frame, or NULL, so the next frame can be encoded into `b` right away
+// (tje_encoder_encode_to_memory and packet_buffer_reserve grow it as needed).
+void server_publish(server * srv, packet_buffer * b, const char * type);
+
+// Accepts clients, reads their requests and sends what they are due. Waits
+// at most `timeout_ms` for something to happen, -1 waits forever.
+void server_poll(server * srv, int timeout_ms);
+
+int server_client_count(server * srv);
+
+// Counters of the client at `index` in [0, server_client_count).
+const server_client_stats * server_client_get_stats(server * srv, int index);
+
+void server_release(server * srv);
+
+
+void server_frame_release(server * srv, server_frame * f)
+{
+    if(f == NULL || --f->refs > 0) {
+        return;
+    }
+    if(srv->spare == NULL) {
+        srv->spare = f->data;
+        srv->spare_capacity = f->capacity;
+    } else {
+        free(f->data);
+    }
+    free(f);
+}
+
+server_frame * server_frame_retain(server_frame * f)
+{
+    if(f) f->refs++;
+    return f;
+}
+
+void server_client_push(server * srv, server_client * c, server_frame * f)
+{
+    if(c->count == srv->queue_depth) {
+        // Latest frame wins: everything still waiting is out of date.
+        while(c->count > 0) {
+            server_frame_release(srv, c->queue[c->head]);
+            c->head = (c->head + 1) % srv->queue_depth;
+            c->count--;
+            c->stats.dropped++;
+        }
+    }
+    c->queue[(c->head + c->count) % srv->queue_depth] = server_frame_retain(f);
+    c->count++;
+}
+
+server_frame * server_client_pop(server * srv, server_client * c)
+{
+    if(c->count == 0) {
+        return NULL;
+    }
+    server_frame * f = c->queue[c->head];
+    c->head = (c->head + 1) % srv->queue_depth;
+    c->count--;
+    return f;
+}
+
+// Registers interest in readability, plus writability while the client has
+// something to send.
+void server_watch(server * srv, server_client * c, int writing)
+{
+#ifdef SERVER_EPOLL
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | (writing ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    epoll_ctl(srv->epoll, c->writing < 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, c->s, &ev);
+#endif
+    c->writing = writing;
+}
+
+void server_client_close(server * srv, int index)
+{
+    server_client * c = srv->clients[index];
+#ifdef SERVER_EPOLL
+    epoll_ctl(srv->epoll, EPOLL_CTL_DEL, c->s, NULL);
+#endif
+    socket_close_peer(c->s);
+    server_frame_release(srv, c->current);
+    while(c->count > 0) {
+        server_frame_release(srv, server_client_pop(srv, c));
+    }
+    free(c->queue);
+    free(c);
+    srv->clients[index] = srv->clients[--srv->count];
+}
+
+int server_client_index(server * srv, server_client * c)
+{
+    for(int i = 0; i < srv->count; i++) {
+        if(srv->clients[i] == c) return i;
+    }
+    return -1;
+}
+
+void server_accept(server * srv)
+{
+    for(;;) {
+        sock s = socket_accept(srv->listener);
+        if(s == SOCKET_INVALID) {
+            return;
+        }
+        if(srv->count == srv->capacity) {
+            int capacity = srv->capacity ? srv->capacity * 2 : 16;
+            server_client ** clients = realloc(srv->clients, capacity * sizeof(server_client *));
+            if(clients == NULL) {
+                socket_close_peer(s);
+                return;
+            }
+            srv->clients = clients;
+            srv->capacity = capacity;
+        }
+        server_client * c = calloc(1, sizeof(server_client));
+        server_frame ** queue = malloc(srv->queue_depth * sizeof(server_frame *));
+        if(c == NULL || queue == NULL) {
+            free(c);
+            free(queue);
+            socket_close_peer(s);
+            return;
+        }
+        c->queue = queue;
+        socket_set_nonblocking(s);
+        c->s = s;
+        c->state = SERVER_CLIENT_REQUEST;
+        c->writing = -1;
+        srv->clients[srv->count++] = c;
+        server_watch(srv, c, 0);
+    }
+}
+
+// Sends as much as the socket takes. Returns 0 when the client is gone.
+int server_client_flush(server * srv, server_client * c)
+{
+    if(c->state != SERVER_CLIENT_STREAM) {
+        return 1;
+    }
+    for(;;) {
+        const unsigned char * data;
+        size_t size;
+        if(c->response_offset < srv->response_size) {
+            data = (const unsigned char *) srv->response + c->response_offset;
+            size = srv->response_size - c->response_offset;
+        } else {
+            if(c->current && c->offset == c->current->size) {
+                server_frame_release(srv, c->current);
+                c->current = NULL;
+                c->stats.sent++;
+            }
+            if(c->current == NULL) {
+                c->current = server_client_pop(srv, c);
+                c->offset = 0;
+            }
+            if(c->current == NULL) {
+                break;
+            }
+            data = c->current->data + c->current->start + c->offset;
+            size = c->current->size - c->offset;
+        }
+
+        int sent = send(c->s, (const char *) data, (int) size, SOCKET_SEND_FLAGS);
+        if(sent < 0) {
+            if(socket_would_block()) {
+                break;
+            }
+            return 0;
+        }
+        if(c->response_offset < srv->response_size) {
+            c->response_offset += sent;
+        } else {
+            c->offset += sent;
+        }
+        c->stats.bytes += sent;
+    }
+    int writing = c->response_offset < srv->response_size || c->current != NULL;
+    if(writing != c->writing) {
+        server_watch(srv, c, writing);
+    }
+    return 1;
+}
+
+// Reads the request until the blank line that ends it, then starts the
+// stream. Anything a streaming client sends is ignored. Returns 0 when the
+// client is gone.
+int server_client_read(server * srv, server_client * c)
+{
+    char discard[512];
+    for(;;) {
+        char * into = discard;
+        int room = sizeof(discard);
+        if(c->state == SERVER_CLIENT_REQUEST) {
+            into = c->request + c->request_size;
+            room = (int) sizeof(c->request) - 1 - c->request_size;
+        }
+        int res = recv(c->s, into, room, 0);
+        if(res == 0) {
+            return 0;
+        }
+        if(res < 0) {
+            return socket_would_block();
+        }
+        if(c->state == SERVER_CLIENT_REQUEST) {
+            c->request_size += res;
+            c->request[c->request_size] = '\0';
+            // Oversized requests are served anyway.
+            if(strstr(c->request, "\r\n\r\n") || c->request_size == (int) sizeof(c->request) - 1) {
+                c->state = SERVER_CLIENT_STREAM;
+                if(srv->latest) {
+                    server_client_push(srv, c, srv->latest);
+                }
+                return server_client_flush(srv, c);
+            }
+        }
+    }
+}
+
+server * server_create(int port, const char * boundary, int queue_depth)
+{
+    sock listener = socket_listen(port);
+    if(listener == SOCKET_INVALID) {
+        return NULL;
+    }
+    socket_set_nonblocking(listener);
+
+    server * srv = calloc(1, sizeof(server));
+    srv->listener = listener;
+    srv->queue_depth = queue_depth > 0 ? queue_depth : SERVER_DEFAULT_QUEUE_DEPTH;
+    snprintf(srv->boundary, sizeof(srv->boundary), "%s", boundary);
+    srv->response_size = snprintf(srv->response, sizeof(srv->response),
+                                  "HTTP/1.0 200 OK\r\n"
+                                  "Cache-Control: no-cache\r\n"
+                                  "Connection: close\r\n"
+                                  "Content-Type: multipart/x-mixed-replace;boundary=%s\r\n\r\n",
+                                  srv->boundary);
+#ifdef SERVER_EPOLL
+    srv->epoll = epoll_create1(0);
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;  // The listener.
+    epoll_ctl(srv->epoll, EPOLL_CTL_ADD, listener, &ev);
+#endif
+    return srv;
+}
+
+void server_publish(server * srv, packet_buffer * b, const char * type)
+{
+    int header = packet_buffer_frame(b, srv->boundary, type);
+    server_frame * f = malloc(sizeof(server_frame));
+    if(header == 0 || f == NULL) {
+        free(f);
+        return;
+    }
+    f->data = b->data;
+    f->capacity = b->capacity;
+    f->start = PACKET_HEADER_SPACE - header;
+    f->size = header + b->size;
+    f->refs = 1;
+
+    b->data = srv->spare;
+    b->capacity = srv->spare_capacity;
+    b->size = 0;
+    srv->spare = NULL;
+    srv->spare_capacity = 0;
+
+    server_frame_release(srv, srv->latest);
+    srv->latest = f;
+
+    for(int i = 0; i < srv->count; i++) {
+        server_client * c = srv->clients[i];
+        if(c->state != SERVER_CLIENT_STREAM) {
+            continue;
+        }
+        server_client_push(srv, c, f);
+        if(!server_client_flush(srv, c)) {
+            server_client_close(srv, i--);
+        }
+    }
+}
+
+#ifdef SERVER_EPOLL
+
+void server_poll(server * srv, int timeout_ms)
+{
+    struct epoll_event events[64];
+    int n = epoll_wait(srv->epoll, events, 64, timeout_ms);
+    for(int i = 0; i < n; i++) {
+        server_client * c = (server_client *) events[i].data.ptr;
+        if(c == NULL) {
+            server_accept(srv);
+            continue;
+        }
+        int alive = 1;
+        if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            alive = server_client_read(srv, c);
+        }
+        if(alive && (events[i].events & EPOLLOUT)) {
+            alive = server_client_flush(srv, c);
+        }
+        if(!alive) {
+            server_client_close(srv, server_client_index(srv, c));
+        }
+    }
+}
+
+#else
+
+void server_poll(server * srv, int timeout_ms)
+{
+    int count = srv->count;
+    server_pollfd * fds = malloc((count + 1) * sizeof(server_pollfd));
+    if(fds == NULL) {
+        return;
+    }
+    fds[0].fd = srv->listener;
+    fds[0].events = POLLIN;
+    for(int i = 0; i < count; i++) {
+        fds[i + 1].fd = srv->clients[i]->s;
+        fds[i + 1].events = POLLIN | (srv->clients[i]->writing > 0 ? POLLOUT : 0);
+    }
+    int n = server_poll_fds(fds, count + 1, timeout_ms);
+    if(n > 0) {
+        // Backwards, so that closing a client (which moves the last one into
+        // its slot) does not disturb the clients still to be handled.
+        for(int i = count - 1; i >= 0; i--) {
+            server_client * c = srv->clients[i];
+            short revents = fds[i + 1].revents;
+            int alive = 1;
+            if(revents & (POLLIN | POLLHUP | POLLERR)) {
+                alive = server_client_read(srv, c);
+            }
+            if(alive && (revents & POLLOUT)) {
+                alive = server_client_flush(srv, c);
+            }
+            if(!alive) {
+                server_client_close(srv, i);
+            }
+        }
+        if(fds[0].revents & POLLIN) {
+            server_accept(srv);
+        }
+    }
+    free(fds);
+}
+
+#endif
+
+int server_client_count(server * srv)
+{
+    return srv->count;
+}
+
+const server_client_stats * server_client_get_stats(server * srv, int index)
+{
+    return &srv->clients[index]->stats;
+}
+
+void server_release(server * srv)
+{
+    while(srv->count > 0) {
+        server_client_close(srv, srv->count - 1);
+    }
+    free(srv->clients);
+    server_frame_release(srv, srv->latest);
+    free(srv->spare);
+#ifdef SERVER_EPOLL
+    close(srv->epoll);
+#endif
+    socket_close_peer(srv->listener);
+    free(srv);
+}
+
+#endif
@@ -0,0 +1,304 @@
+#ifndef __SOURCE_H__
+#define __SOURCE_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "bitmap.h"
+#include "tiles.h"
+#include "screen.h"
+
+// A frame source hides where frames come from so that everything after
+// capture (resize, encode, network) can run on a headless box with
+// reproducible input.
+//
+//  - source_screens:   the platform capture from screen.h
+//  - source_synthetic: deterministic generated content
+//  - source_replay:    raw BGRX frames read back from a file
+
+typedef enum _synthetic_pattern {
+    SYNTHETIC_DESKTOP,  // Static desktop, only the first frame is dirty.
+    SYNTHETIC_TEXT,     // Terminal-like panel of text scrolling one pixel per frame.
+    SYNTHETIC_VIDEO     // Noise and moving gradients in a 16:9 region, like a video player.
+} synthetic_pattern;
+
+typedef struct _source source;
+
+struct _source {
+    const char * name;
+    screens * screens;
+    void * data;
+    bitmap * (*grab)(source * src, screen * s, rects * dirty);
+    void (*release)(source * src);
+};
+
+
+source * source_screens();
+
+source * source_synthetic(int width, int height, synthetic_pattern pattern);
+
+// `path` holds width * height * 4 bytes per frame, played in a loop.
+source * source_replay(const char * path, int width, int height);
+
+// The returned bitmap belongs to the source, see screens_grab.
+bitmap * source_grab(source * src, screen * s, rects * dirty);
+
+void source_release(source * src);
+
+
+bitmap * source_grab(source * src, screen * s, rects * dirty)
+{
+    return src->grab(src, s, dirty);
+}
+
+void source_release(source * src)
+{
+    src->release(src);
+    free(src);
+}
+
+screens * source_single_screen(const char * name, int width, int height)
+{
+    screens * list = malloc(sizeof(screens));
+    screen * scr = calloc(1, sizeof(screen));
+    scr->name = calloc(strlen(name) + 1, sizeof(char));
+    strcpy(scr->name, name);
+    scr->width = width;
+    scr->height = height;
+    list->count = 1;
+    list->list = malloc(sizeof(screen*));
+    list->list[0] = scr;
+    return list;
+}
+
+void source_single_screen_release(screens * list)
+{
+    free(list->list[0]->name);
+    free(list->list[0]);
+    free(list->list);
+    free(list);
+}
+
+// ---- platform capture ----
+
+bitmap * screens_source_grab(source * src, screen * s, rects * dirty)
+{
+    return screens_grab_damage(s, dirty);
+}
+
+void screens_source_release(source * src)
+{
+    screens_release(src->screens);
+}
+
+source * source_screens()
+{
+    source * src = calloc(1, sizeof(source));
+    src->name = "screens";
+    src->screens = screens_get();
+    src->grab = screens_source_grab;
+    src->release = screens_source_release;
+    return src;
+}
+
+// ---- synthetic ----
+
+typedef struct _synthetic {
+    synthetic_pattern pattern;
+    bitmap * frame;
+    uint32_t count;
+} synthetic;
+
+uint32_t synthetic_random(uint32_t * state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+void synthetic_fill(bitmap * b, int x0, int y0, int x1, int y1, uint32_t color)
+{
+    for(int y = y0; y < y1; y++) {
+        uint32_t * row = (uint32_t *)(b->data + (size_t) y * b->stride);
+        for(int x = x0; x < x1; x++) row[x] = color;
+    }
+}
+
+void synthetic_desktop(bitmap * b)
+{
+    // Vertical gradient wallpaper, a task bar and a few flat windows.
+    for(int y = 0; y < b->height; y++) {
+        uint32_t shade = (uint32_t)(40 + 80 * y / (b->height ? b->height : 1));
+        synthetic_fill(b, 0, y, b->width, y + 1, 0xff000000 | (shade / 2) << 16 | (shade / 2) << 8 | shade);
+    }
+    synthetic_fill(b, 0, b->height - b->height / 24, b->width, b->height, 0xff202020);
+    uint32_t seed = 0x2545F491;
+    for(int i = 0; i < 4; i++) {
+        int x0 = synthetic_random(&seed) % (b->width / 2 + 1);
+        int y0 = synthetic_random(&seed) % (b->height / 2 + 1);
+        synthetic_fill(b, x0, y0, x0 + b->width / 3, y0 + b->height / 3, 0xffe8e8e8 - i * 0x00101010);
+        synthetic_fill(b, x0, y0, x0 + b->width / 3, y0 + 24 < b->height ? y0 + 24 : b->height, 0xff3060a0);
+    }
+}
+
+// Glyphs are 6x10 cells whose 5x7 pattern is derived from the character
+// position, which is enough to look (and compress) like text.
+void synthetic_text(bitmap * b, uint32_t frame)
+{
+    const int cw = 6, ch = 10;
+    for(int y = 0; y < b->height; y++) {
+        uint32_t * row = (uint32_t *)(b->data + (size_t) y * b->stride);
+        int line = (int)((y + frame) / ch);
+        int gy = (int)((y + frame) % ch);
+        uint32_t seed = 0x9E3779B9u * (uint32_t)(line + 1);
+        int length = (int)(synthetic_random(&seed) % (b->width / cw + 1));
+        for(int x = 0; x < b->width; x++) {
+            int column = x / cw, gx = x % cw;
+            int ink = 0;
+            if(column < length && gx < 5 && gy < 7) {
+                uint32_t glyph = (uint32_t)(line * 131 + column) * 0x85EBCA77u;
+                glyph ^= glyph >> 15;
+                ink = (glyph >> (gy * 5 + gx) % 32) & 1;
+            }
+            row[x] = ink ? 0xffc0c0c0 : 0xff101010;
+        }
+    }
+}
+
+void synthetic_video(bitmap * b, uint32_t frame, rect * area)
+{
+    uint32_t seed = 0x12345678u ^ (frame * 0x9E3779B9u);
+    if(seed == 0) seed = 1;
+    for(int y = area->y; y < area->y + area->height; y++) {
+        uint32_t * row = (uint32_t *)(b->data + (size_t) y * b->stride);
+        for(int x = area->x; x < area->x + area->width; x++) {
+            uint32_t noise = synthetic_random(&seed) & 0x1f;
+            uint32_t r = (uint32_t)(x + frame * 3) & 0xff;
+            uint32_t g = (uint32_t)(y + frame * 2) & 0xff;
+            uint32_t bl = (uint32_t)(x + y + frame) & 0xff;
+            r = r + noise > 0xff ? 0xff : r + noise;
+            g = g + noise > 0xff ? 0xff : g + noise;
+            bl = bl + noise > 0xff ? 0xff : bl + noise;
+            row[x] = 0xff000000 | r << 16 | g << 8 | bl;
+        }
+    }
+}
+
+bitmap * synthetic_source_grab(source * src, screen * s, rects * dirty)
+{
+    synthetic * syn = (synthetic *) src->data;
+    bitmap * b = syn->frame;
+    uint32_t frame = syn->count++;
+    rects_clear(dirty);
+
+    switch(syn->pattern) {
+    case SYNTHETIC_DESKTOP:
+        if(frame == 0) {
+            synthetic_desktop(b);
+            rects_add(dirty, 0, 0, b->width, b->height);
+        }
+        break;
+    case SYNTHETIC_TEXT:
+        synthetic_text(b, frame);
+        rects_add(dirty, 0, 0, b->width, b->height);
+        break;
+    case SYNTHETIC_VIDEO: {
+        rect area;
+        area.width = b->width * 2 / 3;
+        area.height = area.width * 9 / 16 < b->height ? area.width * 9 / 16 : b->height;
+        area.x = (b->width - area.width) / 2;
+        area.y = (b->height - area.height) / 2;
+        if(frame == 0) {
+            synthetic_desktop(b);
+            rects_add(dirty, 0, 0, b->width, b->height);
+        } else {
+            rects_add(dirty, area.x, area.y, area.width, area.height);
+        }
+        synthetic_video(b, frame, &area);
+        break;
+    }
+    }
+    return b;
+}
+
+void synthetic_source_release(source * src)
+{
+    synthetic * syn = (synthetic *) src->data;
+    bitmap_release(syn->frame);
+    free(syn);
+    source_single_screen_release(src->screens);
+}
+
+source * source_synthetic(int width, int height, synthetic_pattern pattern)
+{
+    source * src = calloc(1, sizeof(source));
+    synthetic * syn = calloc(1, sizeof(synthetic));
+    syn->pattern = pattern;
+    syn->frame = bitmap_create(width, height);
+    src->name = "synthetic";
+    src->screens = source_single_screen("synthetic", width, height);
+    src->data = syn;
+    src->grab = synthetic_source_grab;
+    src->release = synthetic_source_release;
+    return src;
+}
+
+// ---- replay ----
+
+typedef struct _replay {
+    FILE * file;
+    bitmap * frame;
+    tiles * tiles;
+} replay;
+
+bitmap * replay_source_grab(source * src, screen * s, rects * dirty)
+{
+    replay * rep = (replay *) src->data;
+    bitmap * b = rep->frame;
+    size_t size = (size_t) b->stride * b->height;
+
+    if(fread(b->data, 1, size, rep->file) != size) {
+        // Loop back to the first frame.
+        rewind(rep->file);
+        if(fread(b->data, 1, size, rep->file) != size) {
+            return NULL;
+        }
+    }
+    tiles_diff(rep->tiles, b, dirty);
+    return b;
+}
+
+void replay_source_release(source * src)
+{
+    replay * rep = (replay *) src->data;
+    fclose(rep->file);
+    bitmap_release(rep->frame);
+    tiles_release(rep->tiles);
+    free(rep);
+    source_single_screen_release(src->screens);
+}
+
+source * source_replay(const char * path, int width, int height)
+{
+    FILE * file = fopen(path, "rb");
+    if(file == NULL) {
+        printf("Could not open %s\n", path);
+        return NULL;
+    }
+    source * src = calloc(1, sizeof(source));
+    replay * rep = calloc(1, sizeof(replay));
+    rep->file = file;
+    rep->frame = bitmap_create(width, height);
+    rep->tiles = tiles_create(width, height, TILES_DEFAULT_SIZE);
+    src->name = "replay";
+    src->screens = source_single_screen("replay", width, height);
+    src->data = rep;
+    src->grab = replay_source_grab;
+    src->release = replay_source_release;
+    return src;
+}
+
+#endif
@@ -1,46 +1,204 @@
 #ifndef __THREADS_H__
 #define __THREADS_H__
 
+#include <stdlib.h>
+#include "lock.h"
 
 #if defined(_WIN32) || defined(__MINGW32__) || defined(__MINGW64__)
 #include <windows.h>
 typedef HANDLE thread;
+// mingw's gcc ignores __declspec(thread), which would make the scheduler's
+// per-thread state shared by every thread.
+#ifdef _MSC_VER
+#define THREADS_LOCAL __declspec(thread)
+#else
+#define THREADS_LOCAL __thread
+#endif
 #else
 #include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
 typedef pthread_t thread;
+#define THREADS_LOCAL __thread
 #endif
 
 typedef void (*runnable)(void);
 
+typedef void (*runnable_arg)(void * arg);
+
 thread * thread_create(runnable run);
 
+thread * thread_start(runnable_arg run, void * arg);
+
 void thread_join(thread * t);
 
 void thread_release(thread * t);
 
+int cpu_count();
+
+// Gives the rest of the time slice to another thread.
+void thread_yield();
+
+// Fork-join pool of persistent threads: workers_run(w, fn, arg, count) calls
+// fn(arg, i) for every i in [0, count), spread over the workers and the
+// calling thread, and returns once all calls are done.
+typedef void (*parallel_func)(void * arg, int index);
+
+typedef struct _workers {
+    int count;
+    thread ** threads;
+    mutex * lock;
+    cond * wake;
+    cond * done;
+    int stop;
+    unsigned generation;
+    parallel_func func;
+    void * arg;
+    int next;
+    int total;
+    int finished;
+} workers;
+
+// `count` extra threads, 0 means one per CPU minus the caller.
+workers * workers_create(int count);
+
+void workers_run(workers * w, parallel_func func, void * arg, int count);
+
+void workers_release(workers * w);
+
+// Task pool: persistent threads running fn(arg) for every submitted task,
+// taken from a bounded queue in submission order. Submitting blocks while
+// the queue is full, so a producer can't run ahead of the workers.
+//
+// Tasks must not submit to their own pool: with the queue full and every
+// thread blocked in pool_submit (or in future_wait on a queued task) nothing
+// is left to drain it. Nested work belongs on the scheduler below.
+typedef void * (*task_func)(void * arg);
+
+typedef struct _future {
+    int done;
+    void * result;
+} future;
+
+typedef struct _task {
+    task_func func;
+    void * arg;
+    future * result;
+} task;
+
+typedef struct _pool {
+    int count;
+    thread ** threads;
+    mutex * lock;
+    cond * not_empty;
+    cond * not_full;
+    cond * finished;
+    task * queue;       // Ring of `queued` tasks from `head`.
+    int size;
+    int head;
+    int queued;
+    int stop;
+} pool;
+
+// `count` threads, 0 means one per CPU. `queue_size` pending tasks at most,
+// 0 means 4 per thread.
+pool * pool_create(int count, int queue_size);
+
+// Queues fn(arg). The returned future must be passed to future_wait. NULL
+// when the future can't be allocated, nothing is queued then.
+future * pool_submit(pool * p, task_func func, void * arg);
+
+// Queues fn(arg) without a future, its result is dropped.
+void pool_post(pool * p, task_func func, void * arg);
+
+int future_done(pool * p, future * f);
+
+// Waits for the task, frees the future and returns what the task returned.
+void * future_wait(pool * p, future * f);
+
+// Runs the tasks still queued, then stops the threads.
+void pool_release(pool * p);
+
+// Work-stealing scheduler for nested fork-join work, such as one job per
+// screen that splits into one job per slice. Each worker owns a Chase-Lev
+// deque: it pushes and pops its own jobs at the bottom without locking,
+// idle workers steal from the top of a random victim. Uneven jobs are
+// spread by stealing instead of contending on one shared queue.
+typedef struct _job_group {
+    int pending;
+} job_group;
+
+typedef struct _job {
+    parallel_func func;
+    void * arg;
+    int index;
+    job_group * group;
+} job;
+
+#define SCHEDULER_DEQUE_SIZE 1024  // Power of two. Jobs past it run inline.
+
+typedef struct _deque {
+    long top;           // Thieves take from here.
+    long bottom;        // The owner pushes and pops here.
+    job * items[SCHEDULER_DEQUE_SIZE];
+} deque;
+
+typedef struct _scheduler {
+    int count;
+    thread ** threads;
+    deque * deques;     // One per worker, plus one shared by other threads.
+    mutex * outside;    // Serializes pushes to the shared deque.
+    mutex * lock;
+    cond * wake;
+    unsigned epoch;     // Bumped whenever jobs are pushed.
+    int sleepers;
+    int started;
+    int stop;
+} scheduler;
+
+// `count` threads, 0 means one per CPU minus the caller.
+scheduler * scheduler_create(int count);
+
+// Calls func(arg, i) for every i in [0, count) and returns once all calls
+// are done. Can be called from inside a job, the waiting thread runs other
+// jobs in the meantime.
+void scheduler_run(scheduler * s, parallel_func func, void * arg, int count);
+
+// scheduler_run with the scheduler as `context`, the shape of
+// tje_parallel_func.
+void scheduler_parallel(void * context, parallel_func func, void * arg, int count);
+
+void scheduler_release(scheduler * s);
 
-#endif
 
 struct func_holder {
     runnable func;
+    runnable_arg func_arg;
+    void * arg;
 };
 
+void _call(struct func_holder * holder)
+{
+    if(holder->func) {
+        holder->func();
+    } else {
+        holder->func_arg(holder->arg);
+    }
+    free(holder);
+}
+
 #if defined(_WIN32) || defined(__MINGW32__) || defined(__MINGW64__)
 
 DWORD WINAPI _run(LPVOID target)
 {
-    struct func_holder * holder =  (struct func_holder*) target;
-    holder->func();
-    free(holder);
+    _call((struct func_holder*) target);
 //ExitThread(0);
     return 1;
 }
 
-thread * thread_create(runnable run)
+thread * _thread_start(struct func_holder * holder)
 {
     thread * t = malloc(sizeof(thread));
-    struct func_holder * holder = malloc(sizeof(struct func_holder));
-    holder->func = run;
     *t =  CreateThread( NULL, 0, _run, holder, 0, NULL);
     return t;
 }
@@ -56,28 +214,38 @@ void thread_release(thread * t)
     CloseHandle(*t);
 }
 
+int cpu_count()
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int) info.dwNumberOfProcessors;
+}
+
+void thread_yield()
+{
+    SwitchToThread();
+}
+
 
 #else
 
 void * _run(void* target)
 {
-    struct func_holder * holder =  (struct func_holder*) target;
-    holder->func();
-    free(holder);
+    _call((struct func_holder*) target);
     pthread_exit(NULL);
     return NULL;
 }
 
-thread * thread_create(runnable run)
+thread * _thread_start(struct func_holder * holder)
 {
     int ret = 0;
     thread * t = malloc(sizeof(thread));
-    struct func_holder * holder = malloc(sizeof(struct func_holder));
-    holder->func = run;
     ret = pthread_create( t, NULL, _run, holder);
     if (ret == 0) {
         return t;
     }
+    free(holder);
+    free(t);
     return NULL;
 }
 
@@ -91,4 +259,475 @@ void thread_release(thread * t)
     free(t);
 }
 
+int cpu_count()
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int) count : 1;
+}
+
+void thread_yield()
+{
+    sched_yield();
+}
+
+#endif
+
+thread * thread_create(runnable run)
+{
+    struct func_holder * holder = malloc(sizeof(struct func_holder));
+    holder->func = run;
+    holder->func_arg = NULL;
+    holder->arg = NULL;
+    return _thread_start(holder);
+}
+
+thread * thread_start(runnable_arg run, void * arg)
+{
+    struct func_holder * holder = malloc(sizeof(struct func_holder));
+    holder->func = NULL;
+    holder->func_arg = run;
+    holder->arg = arg;
+    return _thread_start(holder);
+}
+
+// Takes indices of the current job until none are left. Called with the
+// lock held, returns with the lock held.
+void _workers_drain(workers * w)
+{
+    while(w->next < w->total) {
+        int index = w->next++;
+        mutex_unlock(w->lock);
+        w->func(w->arg, index);
+        mutex_lock(w->lock);
+        if(++w->finished == w->total) {
+            cond_broadcast(w->done);
+        }
+    }
+}
+
+void _workers_loop(void * arg)
+{
+    workers * w = (workers *) arg;
+    unsigned seen = 0;
+    mutex_lock(w->lock);
+    while(!w->stop) {
+        if(w->generation == seen) {
+            cond_wait(w->wake, w->lock);
+            continue;
+        }
+        seen = w->generation;
+        _workers_drain(w);
+    }
+    mutex_unlock(w->lock);
+}
+
+workers * workers_create(int count)
+{
+    workers * w = calloc(1, sizeof(workers));
+    if(count <= 0) {
+        count = cpu_count() - 1;
+    }
+    w->count = count;
+    w->lock = mutex_create();
+    w->wake = cond_create();
+    w->done = cond_create();
+    w->threads = malloc(count * sizeof(thread*));
+    for(int i = 0; i < count; i++) {
+        w->threads[i] = thread_start(_workers_loop, w);
+    }
+    return w;
+}
+
+void workers_run(workers * w, parallel_func func, void * arg, int count)
+{
+    mutex_lock(w->lock);
+    w->func = func;
+    w->arg = arg;
+    w->next = 0;
+    w->total = count;
+    w->finished = 0;
+    w->generation++;
+    cond_broadcast(w->wake);
+
+    _workers_drain(w);
+    while(w->finished < w->total) {
+        cond_wait(w->done, w->lock);
+    }
+    mutex_unlock(w->lock);
+}
+
+void workers_release(workers * w)
+{
+    mutex_lock(w->lock);
+    w->stop = 1;
+    cond_broadcast(w->wake);
+    mutex_unlock(w->lock);
+    for(int i = 0; i < w->count; i++) {
+        thread_join(w->threads[i]);
+        thread_release(w->threads[i]);
+    }
+    free(w->threads);
+    cond_release(w->wake);
+    cond_release(w->done);
+    mutex_release(w->lock);
+    free(w);
+}
+
+void _pool_loop(void * arg)
+{
+    pool * p = (pool *) arg;
+    mutex_lock(p->lock);
+    for(;;) {
+        while(p->queued == 0 && !p->stop) {
+            cond_wait(p->not_empty, p->lock);
+        }
+        if(p->queued == 0) {
+            break;
+        }
+        task t = p->queue[p->head];
+        p->head = (p->head + 1) % p->size;
+        p->queued--;
+        cond_signal(p->not_full);
+        mutex_unlock(p->lock);
+
+        void * result = t.func(t.arg);
+
+        mutex_lock(p->lock);
+        if(t.result) {
+            t.result->result = result;
+            t.result->done = 1;
+            cond_broadcast(p->finished);
+        }
+    }
+    mutex_unlock(p->lock);
+}
+
+pool * pool_create(int count, int queue_size)
+{
+    pool * p = calloc(1, sizeof(pool));
+    if(count <= 0) {
+        count = cpu_count();
+    }
+    if(queue_size <= 0) {
+        queue_size = 4 * count;
+    }
+    p->count = count;
+    p->size = queue_size;
+    p->queue = malloc(queue_size * sizeof(task));
+    p->lock = mutex_create();
+    p->not_empty = cond_create();
+    p->not_full = cond_create();
+    p->finished = cond_create();
+    p->threads = malloc(count * sizeof(thread*));
+    for(int i = 0; i < count; i++) {
+        p->threads[i] = thread_start(_pool_loop, p);
+    }
+    return p;
+}
+
+void _pool_push(pool * p, task_func func, void * arg, future * f)
+{
+    mutex_lock(p->lock);
+    while(p->queued == p->size) {
+        cond_wait(p->not_full, p->lock);
+    }
+    task * t = &p->queue[(p->head + p->queued) % p->size];
+    t->func = func;
+    t->arg = arg;
+    t->result = f;
+    p->queued++;
+    cond_signal(p->not_empty);
+    mutex_unlock(p->lock);
+}
+
+future * pool_submit(pool * p, task_func func, void * arg)
+{
+    future * f = calloc(1, sizeof(future));
+    if(f == NULL) {
+        return NULL;
+    }
+    _pool_push(p, func, arg, f);
+    return f;
+}
+
+void pool_post(pool * p, task_func func, void * arg)
+{
+    _pool_push(p, func, arg, NULL);
+}
+
+int future_done(pool * p, future * f)
+{
+    mutex_lock(p->lock);
+    int done = f->done;
+    mutex_unlock(p->lock);
+    return done;
+}
+
+void * future_wait(pool * p, future * f)
+{
+    mutex_lock(p->lock);
+    while(!f->done) {
+        cond_wait(p->finished, p->lock);
+    }
+    mutex_unlock(p->lock);
+    void * result = f->result;
+    free(f);
+    return result;
+}
+
+void pool_release(pool * p)
+{
+    mutex_lock(p->lock);
+    p->stop = 1;
+    cond_broadcast(p->not_empty);
+    mutex_unlock(p->lock);
+    for(int i = 0; i < p->count; i++) {
+        thread_join(p->threads[i]);
+        thread_release(p->threads[i]);
+    }
+    free(p->threads);
+    free(p->queue);
+    cond_release(p->not_empty);
+    cond_release(p->not_full);
+    cond_release(p->finished);
+    mutex_release(p->lock);
+    free(p);
+}
+
+// ---- work stealing ----
+
+// Index of the calling thread's deque in the scheduler it works for.
+THREADS_LOCAL scheduler * _scheduler_self;
+THREADS_LOCAL int _scheduler_index;
+THREADS_LOCAL unsigned _scheduler_seed;
+
+// Chase-Lev deque, "Dynamic Circular Work-Stealing Deque" with the C11
+// orderings of Le et al. Fixed size: push fails when full.
+int _deque_push(deque * d, job * j)
+{
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    if(b - t >= SCHEDULER_DEQUE_SIZE) {
+        return 0;
+    }
+    __atomic_store_n(&d->items[b & (SCHEDULER_DEQUE_SIZE - 1)], j, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+job * _deque_pop(deque * d)
+{
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+    if(t > b) {
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    job * j = __atomic_load_n(&d->items[b & (SCHEDULER_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if(t == b) {
+        // Last job, race the thieves for it.
+        if(!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            j = NULL;
+        }
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return j;
+}
+
+job * _deque_steal(deque * d)
+{
+    long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    if(t >= b) {
+        return NULL;
+    }
+    job * j = __atomic_load_n(&d->items[t & (SCHEDULER_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if(!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    return j;
+}
+
+void _scheduler_execute(job * j)
+{
+    j->func(j->arg, j->index);
+    __atomic_sub_fetch(&j->group->pending, 1, __ATOMIC_RELEASE);
+}
+
+// Own deque first (most recent job, still in cache), then the others
+// starting from a random one.
+job * _scheduler_find(scheduler * s, int self)
+{
+    int total = s->count + 1;
+    job * j = NULL;
+    if(self < s->count) {
+        j = _deque_pop(&s->deques[self]);
+    }
+    if(j) {
+        return j;
+    }
+    unsigned x = _scheduler_seed ? _scheduler_seed : (unsigned) self * 0x9E3779B9u + 1;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    _scheduler_seed = x;
+    int start = (int)(x % (unsigned) total);
+    for(int i = 0; i < total && !j; i++) {
+        int victim = (start + i) % total;
+        if(victim != self) {
+            j = _deque_steal(&s->deques[victim]);
+        }
+    }
+    return j;
+}
+
+void _scheduler_loop(void * arg)
+{
+    scheduler * s = (scheduler *) arg;
+    mutex_lock(s->lock);
+    int self = s->started++;
+    mutex_unlock(s->lock);
+    _scheduler_self = s;
+    _scheduler_index = self;
+    for(;;) {
+        unsigned epoch = __atomic_load_n(&s->epoch, __ATOMIC_SEQ_CST);
+        job * j = _scheduler_find(s, self);
+        if(j) {
+            _scheduler_execute(j);
+            continue;
+        }
+        // Nothing found. Sleep unless jobs were pushed since the search
+        // started: pushers bump the epoch before checking for sleepers.
+        mutex_lock(s->lock);
+        __atomic_add_fetch(&s->sleepers, 1, __ATOMIC_SEQ_CST);
+        while(!s->stop && __atomic_load_n(&s->epoch, __ATOMIC_SEQ_CST) == epoch) {
+            cond_wait(s->wake, s->lock);
+        }
+        __atomic_sub_fetch(&s->sleepers, 1, __ATOMIC_SEQ_CST);
+        int stop = s->stop;
+        mutex_unlock(s->lock);
+        if(stop) {
+            break;
+        }
+    }
+}
+
+scheduler * scheduler_create(int count)
+{
+    scheduler * s = calloc(1, sizeof(scheduler));
+    if(count <= 0) {
+        count = cpu_count() - 1;
+    }
+    s->count = count;
+    s->deques = calloc(count + 1, sizeof(deque));
+    s->outside = mutex_create();
+    s->lock = mutex_create();
+    s->wake = cond_create();
+    s->threads = malloc(count * sizeof(thread*));
+    for(int i = 0; i < count; i++) {
+        s->threads[i] = thread_start(_scheduler_loop, s);
+    }
+    return s;
+}
+
+void _scheduler_notify(scheduler * s)
+{
+    __atomic_add_fetch(&s->epoch, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&s->sleepers, __ATOMIC_SEQ_CST) > 0) {
+        mutex_lock(s->lock);
+        cond_broadcast(s->wake);
+        mutex_unlock(s->lock);
+    }
+}
+
+void scheduler_run(scheduler * s, parallel_func func, void * arg, int count)
+{
+    if(count <= 0) {
+        return;
+    }
+    // Workers push to their own deque, any other thread to the shared one.
+    int self = _scheduler_self == s ? _scheduler_index : s->count;
+    deque * d = &s->deques[self];
+    job_group group;
+    job local[16];
+    job * jobs = count <= 16 ? local : malloc(count * sizeof(job));
+    group.pending = count;
+
+    for(int i = 0; i < count; i++) {
+        jobs[i].func = func;
+        jobs[i].arg = arg;
+        jobs[i].index = i;
+        jobs[i].group = &group;
+    }
+
+    // Pushed in reverse so that the owner pops them in order. Jobs that don't
+    // fit, and job 0, are run by the calling thread.
+    int kept = 0;
+    if(self == s->count) {
+        mutex_lock(s->outside);
+    }
+    for(int i = count - 1; i > 0; i--) {
+        if(!_deque_push(d, &jobs[i])) {
+            kept = i;
+            break;
+        }
+    }
+    if(self == s->count) {
+        mutex_unlock(s->outside);
+    }
+    if(kept < count - 1) {
+        _scheduler_notify(s);
+    }
+
+    for(int i = 0; i <= kept; i++) {
+        _scheduler_execute(&jobs[i]);
+    }
+    while(__atomic_load_n(&group.pending, __ATOMIC_ACQUIRE) > 0) {
+        job * j = NULL;
+        if(self == s->count) {
+            // Only workers may pop the shared deque from the bottom.
+            for(int i = 0; i <= s->count && !j; i++) {
+                j = _deque_steal(&s->deques[i]);
+            }
+        } else {
+            j = _scheduler_find(s, self);
+        }
+        if(j) {
+            _scheduler_execute(j);
+        } else {
+            thread_yield();
+        }
+    }
+    if(jobs != local) {
+        free(jobs);
+    }
+}
+
+void scheduler_parallel(void * context, parallel_func func, void * arg, int count)
+{
+    scheduler_run((scheduler *) context, func, arg, count);
+}
+
+void scheduler_release(scheduler * s)
+{
+    mutex_lock(s->lock);
+    s->stop = 1;
+    cond_broadcast(s->wake);
+    mutex_unlock(s->lock);
+    for(int i = 0; i < s->count; i++) {
+        thread_join(s->threads[i]);
+        thread_release(s->threads[i]);
+    }
+    free(s->threads);
+    free(s->deques);
+    cond_release(s->wake);
+    mutex_release(s->lock);
+    mutex_release(s->outside);
+    free(s);
+}
+
 #endif
@@ -0,0 +1,189 @@
+#ifndef __TILES_H__
+#define __TILES_H__
+
+#include <stdint.h>
+#include <string.h>
+#include "bitmap.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TILES_SSE2 1
+#endif
+
+// Software change detection for sources without damage reporting. Frames are
+// cut into size x size tiles, every tile is hashed and compared with the hash
+// it had in the previous frame.
+
+#define TILES_DEFAULT_SIZE 64
+
+typedef struct _tiles {
+    int width;
+    int height;
+    int size;
+    int cols;
+    int rows;
+    int primed;
+    uint64_t * hashes;
+    uint64_t * acc;
+} tiles;
+
+
+tiles * tiles_create(int width, int height, int size);
+
+// Hashes `b` and fills `dirty` with the tiles that differ from the previous
+// call, horizontally adjacent tiles merged into one rect. The first call (or
+// a call with a different bitmap size) reports the whole bitmap.
+void tiles_diff(tiles * t, bitmap * b, rects * dirty);
+
+void tiles_release(tiles * t);
+
+
+#define TILES_PRIME64_1 0x9E3779B185EBCA87ULL
+#define TILES_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define TILES_PRIME32_1 0x9E3779B1U
+#define TILES_PRIME32_2 0x85EBCA77U
+
+void tiles_init(tiles * t, int width, int height, int size)
+{
+    t->width = width;
+    t->height = height;
+    t->size = size;
+    t->cols = (width + size - 1) / size;
+    t->rows = (height + size - 1) / size;
+    t->primed = 0;
+    t->hashes = calloc((size_t)t->cols * t->rows, sizeof(uint64_t));
+    // Two 64 bit lanes of running state per tile column.
+    t->acc = calloc((size_t)t->cols * 2, sizeof(uint64_t));
+}
+
+tiles * tiles_create(int width, int height, int size)
+{
+    tiles * t = malloc(sizeof(tiles));
+    tiles_init(t, width, height, size > 0 ? size : TILES_DEFAULT_SIZE);
+    return t;
+}
+
+void tiles_release(tiles * t)
+{
+    free(t->hashes);
+    free(t->acc);
+    free(t);
+}
+
+uint64_t tiles_avalanche(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= TILES_PRIME64_2;
+    h ^= h >> 29;
+    h *= TILES_PRIME64_1;
+    h ^= h >> 32;
+    return h;
+}
+
+// Folds `len` bytes (multiple of 4) of one tile row into the two lane state
+// of that tile. Same mixing as the XXH3 stripe accumulator: each 32 bit word
+// is keyed, multiplied with its neighbour and the raw data is added back.
+#ifdef TILES_SSE2
+
+void tiles_hash_row(uint64_t * acc, const char * row, int len, uint32_t key)
+{
+    __m128i a = _mm_loadu_si128((const __m128i *) acc);
+    __m128i k = _mm_set_epi32(key ^ TILES_PRIME32_2, key + TILES_PRIME32_1,
+                              key ^ TILES_PRIME32_1, key + TILES_PRIME32_2);
+    const __m128i step = _mm_set1_epi32((int) TILES_PRIME32_1);
+    int i = 0;
+    for(; i + 16 <= len; i += 16) {
+        __m128i data = _mm_loadu_si128((const __m128i *)(row + i));
+        __m128i keyed = _mm_xor_si128(data, k);
+        __m128i shifted = _mm_shuffle_epi32(keyed, _MM_SHUFFLE(0, 3, 0, 1));
+        __m128i product = _mm_mul_epu32(keyed, shifted);
+        __m128i swapped = _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+        a = _mm_add_epi64(a, _mm_add_epi64(product, swapped));
+        k = _mm_add_epi32(k, step);
+    }
+    _mm_storeu_si128((__m128i *) acc, a);
+    for(; i < len; i += 4) {
+        uint32_t word;
+        memcpy(&word, row + i, 4);
+        acc[0] = (acc[0] ^ word) * TILES_PRIME64_1;
+    }
+}
+
+#else
+
+void tiles_hash_row(uint64_t * acc, const char * row, int len, uint32_t key)
+{
+    uint32_t k[4] = { key + TILES_PRIME32_2, key ^ TILES_PRIME32_1,
+                      key + TILES_PRIME32_1, key ^ TILES_PRIME32_2
+                    };
+    int i = 0;
+    for(; i + 16 <= len; i += 16) {
+        uint32_t data[4];
+        memcpy(data, row + i, 16);
+        for(int lane = 0; lane < 2; lane++) {
+            uint32_t lo = data[2 * lane] ^ k[2 * lane];
+            uint32_t hi = data[2 * lane + 1] ^ k[2 * lane + 1];
+            uint64_t swapped = (uint64_t) data[2 * (1 - lane)] | ((uint64_t) data[2 * (1 - lane) + 1] << 32);
+            acc[lane] += (uint64_t) lo * hi + swapped;
+        }
+        for(int j = 0; j < 4; j++) k[j] += TILES_PRIME32_1;
+    }
+    for(; i < len; i += 4) {
+        uint32_t word;
+        memcpy(&word, row + i, 4);
+        acc[0] = (acc[0] ^ word) * TILES_PRIME64_1;
+    }
+}
+
+#endif
+
+void tiles_diff(tiles * t, bitmap * b, rects * dirty)
+{
+    rects_clear(dirty);
+    if(b->width != t->width || b->height != t->height) {
+        free(t->hashes);
+        free(t->acc);
+        tiles_init(t, b->width, b->height, t->size);
+    }
+
+    for(int ty = 0; ty < t->rows; ty++) {
+        int y0 = ty * t->size;
+        int y1 = y0 + t->size < t->height ? y0 + t->size : t->height;
+
+        for(int tx = 0; tx < t->cols; tx++) {
+            t->acc[2 * tx] = TILES_PRIME64_1 ^ (uint64_t)(ty * t->cols + tx);
+            t->acc[2 * tx + 1] = TILES_PRIME64_2;
+        }
+        for(int y = y0; y < y1; y++) {
+            const char * row = b->data + (size_t) y * b->stride;
+            for(int tx = 0; tx < t->cols; tx++) {
+                int x0 = tx * t->size;
+                int w = x0 + t->size < t->width ? t->size : t->width - x0;
+                tiles_hash_row(&t->acc[2 * tx], row + x0 * BITMAP_BPP, w * BITMAP_BPP,
+                               (uint32_t)(y - y0) * TILES_PRIME32_2);
+            }
+        }
+
+        int run = -1;
+        for(int tx = 0; tx <= t->cols; tx++) {
+            int changed = 0;
+            if(tx < t->cols) {
+                uint64_t h = tiles_avalanche(t->acc[2 * tx] ^ tiles_avalanche(t->acc[2 * tx + 1]));
+                uint64_t * slot = &t->hashes[ty * t->cols + tx];
+                changed = !t->primed || *slot != h;
+                *slot = h;
+            }
+            if(changed && run < 0) {
+                run = tx;
+            } else if(!changed && run >= 0) {
+                int x0 = run * t->size;
+                int x1 = tx * t->size < t->width ? tx * t->size : t->width;
+                rects_add(dirty, x0, y0, x1 - x0, y1 - y0);
+                run = -1;
+            }
+        }
+    }
+    t->primed = 1;
+}
+
+#endif